@@ -62,3 +62,14 @@ void addrLoad(void) {
 	default: addrGet() = ADDR_INVALID;
 	}
 }
+
+int addrSlot(void) {
+	switch (addrGet()) {
+	case ADDR_RIBS: return 0;
+	case ADDR_PURR: return 1;
+	case ADDR_SPINE: return 2;
+	case ADDR_HEAD_YAW: return 3;
+	case ADDR_HEAD_PITCH: return 4;
+	default: return -1;
+	}
+}
@@ -62,6 +62,24 @@ Check if the input address matches the board address.
 
 /*
 
+Get the four bit node number of the board address, used to match USART
+address marks. The low nibbles of the board addresses are distinct.
+
+*/
+#define addrNode() (addrGet() & 0x0f)
+
+/*
+
+Get the response slot of the board for broadcast polls, numbered from
+the rear to the head of the CuddleBot.
+
+@return Slot number, or -1 if the address is invalid
+
+*/
+int addrSlot(void);
+
+/*
+
 Check if the address is for the purr motor.
 
 @param addr input address
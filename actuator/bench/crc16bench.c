@@ -0,0 +1,144 @@
+/*
+
+Cuddlebot actuator firmware - Copyright (C) 2014 Michael Phan-Ba
+
+Property of SPIN Research Group
+ICICS/CS Building X508-2366 Main Mall
+Vancouver, B.C. V6T 1Z4 Canada
+(604) 822 8169 - maclean@cs.ubc.ca
+
+*/
+
+/*
+
+Host benchmark and equivalence check for the slicing-by-4 crc16UpdateN().
+
+Checks that each slicing table entry follows from the byte table, and
+that crc16UpdateN() gives the same checksum as crc16Update() on each byte
+for every length up to BENCH_SIZE and every alignment. Then times both
+on a BENCH_SIZE buffer and reports bytes per cycle of a BENCH_HZ clock,
+to compare with the figure on the target. Build and run on the host from
+this directory, stating the host clock:
+
+  cc -O2 -DBENCH_HZ=3000000000 -o crc16bench crc16bench.c && ./crc16bench
+
+Exits with a nonzero status if any check fails.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// the slicing tables are static, so include the implementation
+#include "../crc16.c"
+
+/* Size of the largest message, and of the timed buffer. */
+#define BENCH_SIZE                      1024
+
+/* Number of timed runs, of which the fastest is reported. */
+#define BENCH_RUNS                      2000
+
+/* Host CPU clock in Hz, to convert times to cycles. */
+#if !defined(BENCH_HZ)
+#define BENCH_HZ                        3000000000.0
+#endif
+
+static uint8_t buf[BENCH_SIZE + 4];
+
+/* Reference checksum, one byte at a time. */
+static uint16_t bytewise(const uint8_t *bp, size_t n) {
+	crc16_t c;
+	size_t i;
+	crc16Reset(&c);
+	for (i = 0; i < n; i++) {
+		crc16Update(&c, bp[i]);
+	}
+	return crc16Value(&c);
+}
+
+static uint16_t sliced(const uint8_t *bp, size_t n) {
+	crc16_t c;
+	crc16Reset(&c);
+	crc16UpdateN(&c, bp, n);
+	return crc16Value(&c);
+}
+
+/* Check the slicing tables: each advances the previous one by a zero byte. */
+static int check_tables(void) {
+	const uint16_t *tabs[] = {tab, tab1, tab2, tab3};
+	int errors = 0;
+	size_t t, i;
+	for (t = 1; t < 4; t++) {
+		for (i = 0; i < 256; i++) {
+			uint16_t p = tabs[t - 1][i];
+			uint16_t v = tab[p & 0xff] ^ (p >> 8);
+			if (tabs[t][i] != v) {
+				printf("tab%u[%u] = 0x%04x, expected 0x%04x\n",
+				       (unsigned)t, (unsigned)i, tabs[t][i], v);
+				errors++;
+			}
+		}
+	}
+	return errors;
+}
+
+/* Check crc16UpdateN() against crc16Update() for all lengths and offsets. */
+static int check_equal(void) {
+	int errors = 0;
+	size_t off, n;
+	for (off = 0; off < 4; off++) {
+		for (n = 0; n <= BENCH_SIZE; n++) {
+			uint16_t a = bytewise(&buf[off], n);
+			uint16_t b = sliced(&buf[off], n);
+			if (a != b) {
+				printf("offset %u length %u: 0x%04x != 0x%04x\n",
+				       (unsigned)off, (unsigned)n, b, a);
+				errors++;
+			}
+		}
+	}
+	return errors;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Time the fastest of BENCH_RUNS checksums of the buffer, in bytes/cycle. */
+static double bench(uint16_t (*fn)(const uint8_t *, size_t)) {
+	volatile uint16_t sink = 0;
+	double best = 1e9;
+	int i;
+	for (i = 0; i < BENCH_RUNS; i++) {
+		double start = now();
+		sink ^= fn(buf, BENCH_SIZE);
+		double t = now() - start;
+		if (t < best) {
+			best = t;
+		}
+	}
+	(void)sink;
+	return BENCH_SIZE / (best * BENCH_HZ);
+}
+
+int main(void) {
+	size_t i;
+	srand(1);
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = rand();
+	}
+
+	int errors = check_tables() + check_equal();
+	printf("equivalence: %s\n", errors == 0 ? "ok" : "FAILED");
+
+	double a = bench(bytewise);
+	double b = bench(sliced);
+	printf("bytes/cycle at %.2f GHz\n", BENCH_HZ / 1e9);
+	printf("bytewise      %.3f\n", a);
+	printf("slicing-by-4  %.3f (%.2fx)\n", b, b / a);
+
+	return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -10,15 +10,20 @@ Vancouver, B.C. V6T 1Z4 Canada
 */
 
 #include <math.h>
+#include <stddef.h>
+#include <string.h>
 
 #include <ch.h>
 #include <hal.h>
 #include <chprintf.h>
+#include <memstreams.h>
 
 #include "addr.h"
 #include "comm.h"
 #include "commtest.h"
 #include "crc16.h"
+#include "crc32.h"
+#include "crc32hw.h"
 #include "motor.h"
 #include "motion.h"
 #include "msgtype.h"
@@ -27,42 +32,412 @@ Vancouver, B.C. V6T 1Z4 Canada
 
 CommDriver COMM1;
 
+static msg_t rx_thread(void *p);
+msg_t comm_lld_bundle(CommDriver *comm, commframe_t *frame);
+
 void commInit(void) {
 	commObjectInit(&COMM1);
 }
 
 void commObjectInit(CommDriver *comm) {
 	comm->state = COMM_STOP;
+	comm->brstate = COMM_BITRATE_IDLE;
+	comm->brspeed = SERIAL_DEFAULT_BITRATE;
+	comm->brtime = 0;
+	comm->streamseq = 0;
+	comm->seqlast = 0;
+	comm->seqseen = 0;
+	memset(&comm->stats, 0, sizeof(comm->stats));
+	comm->framing = MSGTYPE_FRAMING_V1;
+	comm->rxcrc32 = false;
+	comm->abortgen = 0;
+	comm->servicegen = 0;
+	chSemInit(&comm->rxfree, COMM_RXQUEUE_COUNT);
+	chPoolInit(&comm->rxpool, sizeof(commframe_t), NULL);
+	chPoolLoadArray(&comm->rxpool, comm->rxframes, COMM_RXQUEUE_COUNT);
+	chMBInit(&comm->rxmbox, comm->rxmbox_buf, COMM_RXQUEUE_COUNT);
+	comm->rxthread_tp = NULL;
+}
+
+/*
+
+Stop all motion on a line break. Frames received before the break are
+dropped, including those waiting to be serviced or being serviced.
+
+*/
+static void comm_lld_break(void) {
+	COMM1.abortgen++;
+	motionAbortI(&MOTION2);
+}
+
+/*
+
+Set the live target unless a line break has stopped all motion since
+the frame was received.
+
+@param comm The comm driver
+@param gen Line breaks before the frame was received
+@param setpoint The target setpoint
+@param timeout Time to hold the target, in ms
+
+*/
+void comm_lld_set_target(CommDriver *comm, uint32_t gen, uint16_t setpoint,
+                         uint16_t timeout) {
+	chSysLock();
+	if (gen == comm->abortgen) {
+		motionSetTarget(&MOTION2, setpoint, timeout);
+	}
+	chSysUnlock();
 }
 
 void commStart(CommDriver *comm, CommConfig *config) {
 	if (comm->state == COMM_STOP) {
 		comm->config = *config;
+		crc32hwInit();
+#if COMM_USE_ADDRMARK
+		// wake only on address marks for this board
+		rs485SetAddressMark(comm->config.io.rsdp, addrNode());
+		rs485Mute(comm->config.io.rsdp);
+#endif
+#if !COMM_USE_ADDRMARK
+		// stop on a line break, even in the middle of a frame
+		rs485SetBreakCallback(comm->config.io.rsdp, comm_lld_break);
+#endif
+		// start receive thread
+		comm->rxthread_tp = chThdCreateStatic(
+		                      comm->rxthread_wa, sizeof(comm->rxthread_wa),
+		                      NORMALPRIO + 1, rx_thread, comm);
 	}
 	comm->state = COMM_READY;
 }
 
+/* Checksum state of comm_lld_pull(). */
+typedef struct {
+	CommDriver *comm;
+	uint8_t *dst;                         // buffer being filled, or NULL
+	crc16_t *c;                           // checksum to update, or NULL
+	size_t i;                             // bytes pulled
+	size_t fed;                           // bytes fed to the CRC unit
+} commpull_t;
+
+/* Update the checksums with a span of bytes pulled from the ring. */
+void comm_lld_pull_span(void *arg, const uint8_t *bp, size_t n) {
+	commpull_t *p = arg;
+
+	if (p->c != NULL) {
+		crc16UpdateN(p->c, bp, n);
+	}
+	p->i += n;
+
+	if (p->comm->rxcrc32 && p->dst != NULL && (p->i & ~3) > p->fed) {
+		crc32hwFeed(&p->dst[p->fed], ((p->i & ~3) - p->fed) / 4);
+		p->fed = p->i & ~3;
+	}
+}
+
+/*
+
+Pull bytes for the frame parser straight out of the RS-485 receive ring.
+Bytes are discarded from the ring without copying if `bp` is NULL. The
+checksum is updated as the bytes arrive, so that it is ready as soon as
+the last byte of a frame is received. While `rxcrc32` is set, whole words
+of the buffer are fed to the CRC unit by DMA while the next bytes arrive;
+the buffer must then be word aligned.
+
+@param comm The comm driver
+@param bp Buffer to save data, or NULL to discard
+@param n Number of bytes to pull
+@param time Timeout for all bytes
+@param c Checksum to update with the bytes, or NULL
+@return Number of bytes pulled
+
+*/
+size_t comm_lld_pull(CommDriver *comm, void *bp, size_t n, systime_t time,
+                     crc16_t *c) {
+	commpull_t p = {comm, bp, c, 0, 0};
+	return rs485Read(comm->config.io.rsdp, bp, n, time,
+	                 comm_lld_pull_span, &p);
+}
+
+/*
+
+Count a frame cut short. Receive errors are counted by the RS-485
+driver, so only timeouts are counted here.
+
+@param comm The comm driver
+
+*/
+void comm_lld_short(CommDriver *comm) {
+	if (comm->config.io.rsdp->err == RDY_TIMEOUT) {
+		comm->stats.timeouts++;
+	}
+}
+
+/*
+
+Advance a bit rate change in progress: switch to the new bit rate when
+it is time, or fall back to the default bit rate if no valid frame has
+been received in time. Changes are requested by the service thread, so
+the bit rate change state is only accessed with the system locked.
+
+@param comm The comm driver
+@return Time until the next change, or TIME_INFINITE if none
+
+*/
+systime_t comm_lld_bitrate(CommDriver *comm) {
+	RS485Driver *rsp = comm->config.io.rsdp;
+
+	chSysLock();
+	commbitrate_t state = comm->brstate;
+	uint32_t speed = comm->brspeed;
+	systime_t wait = comm->brtime - chTimeNow();
+	chSysUnlock();
+
+	if (state == COMM_BITRATE_IDLE) {
+		return TIME_INFINITE;
+	}
+	if ((int32_t)wait > 0) {
+		return wait;
+	}
+
+	if (state == COMM_BITRATE_PENDING) {
+		rs485SetBitrate(rsp, speed);
+		chSysLock();
+		// leave a change requested since pending
+		if (comm->brstate == COMM_BITRATE_PENDING && comm->brspeed == speed) {
+			comm->brstate = COMM_BITRATE_VERIFY;
+			comm->brtime = chTimeNow() + MS2ST(MSGTYPE_BITRATE_TIMEOUT_MS);
+		}
+		chSysUnlock();
+		return MS2ST(MSGTYPE_BITRATE_TIMEOUT_MS);
+	}
+
+	// not verified in time
+	rs485SetBitrate(rsp, SERIAL_DEFAULT_BITRATE);
+	chSysLock();
+	if (comm->brstate == COMM_BITRATE_VERIFY) {
+		comm->brstate = COMM_BITRATE_IDLE;
+	}
+	chSysUnlock();
+	return TIME_INFINITE;
+}
+
+/*
+
+Confirm a new bit rate on receiving a valid frame.
+
+@param comm The comm driver
+
+*/
+void comm_lld_bitrate_verified(CommDriver *comm) {
+	chSysLock();
+	if (comm->brstate == COMM_BITRATE_VERIFY) {
+		comm->brstate = COMM_BITRATE_IDLE;
+	}
+	chSysUnlock();
+}
+
+/*
+
+Build a response frame from this board in a transmit buffer, in the
+frame version in use.
+
+@param comm The comm driver
+@param tbp The transmit buffer
+@param type The message type
+@param data The message data
+@param size The message size
+
+*/
+void comm_lld_frame(CommDriver *comm, rs485txbuf_t *tbp, uint8_t type,
+                    const void *data, uint16_t size) {
+	msgtype_header_t header = {addrGet(), type, size};
+	const size_t n = sizeof(header) + size;
+
+	if (comm->framing == MSGTYPE_FRAMING_V2) {
+		header.size |= MSGTYPE_SIZE_CRC32;
+	}
+	memcpy(tbp->data, &header, sizeof(header));
+	memcpy(&tbp->data[sizeof(header)], data, size);
+
+	if (comm->framing == MSGTYPE_FRAMING_V2) {
+		msgtype_footer32_t footer;
+		crc32_t c;
+		crc32Reset(&c);
+		crc32UpdateN(&c, tbp->data, n);
+		footer.crc32 = crc32Value(&c);
+		memcpy(&tbp->data[n], &footer, sizeof(footer));
+		tbp->n = n + sizeof(footer);
+	} else {
+		msgtype_footer_t footer;
+		crc16_t c;
+		crc16Reset(&c);
+		crc16UpdateN(&c, tbp->data, n);
+		footer.crc16 = crc16Value(&c);
+		memcpy(&tbp->data[n], &footer, sizeof(footer));
+		tbp->n = n + sizeof(footer);
+	}
+}
+
+/*
+
+Check if a sequence number has been accepted recently.
+
+@param comm The comm driver
+@param seq The sequence number
+@return true if the sequence number is in the window of accepted ones
+
+*/
+bool comm_lld_seq_seen(CommDriver *comm, uint16_t seq) {
+	uint16_t age = comm->seqlast - seq;
+	return age < COMM_SEQ_WINDOW && (comm->seqseen & (1UL << age));
+}
+
+/*
+
+Record an accepted sequence number, sliding the window forward if the
+sequence number is newer than all others. A sequence number far outside
+the window restarts the window, e.g. after the master restarts.
+
+@param comm The comm driver
+@param seq The sequence number
+
+*/
+void comm_lld_seq_accept(CommDriver *comm, uint16_t seq) {
+	int16_t ahead = seq - comm->seqlast;
+
+	if (comm->seqseen != 0 && ahead > 0 && ahead < COMM_SEQ_WINDOW) {
+		comm->seqseen = (comm->seqseen << ahead) | 1;
+		comm->seqlast = seq;
+	} else if (comm->seqseen != 0 && ahead <= 0 && -ahead < COMM_SEQ_WINDOW) {
+		comm->seqseen |= 1UL << -ahead;
+	} else {
+		comm->seqseen = 1;
+		comm->seqlast = seq;
+	}
+}
+
+/*
+
+Send an acknowledgement response for a sequenced message.
+
+@param comm The comm driver
+@param type MSGTYPE_ACK or MSGTYPE_NACK
+@param seq The sequence number
+
+*/
+void comm_lld_ack(CommDriver *comm, uint8_t type, uint16_t seq) {
+	RS485Driver *rsp = comm->config.io.rsdp;
+	msgtype_ack_t ack = {seq};
+
+	rs485txbuf_t *tbp = rs485TxAlloc(rsp);
+	if (tbp == NULL) {
+		return;
+	}
+	comm_lld_frame(comm, tbp, type, &ack, sizeof(ack));
+	rs485TxPost(rsp, tbp);
+}
+
+/*
+
+Receive the rest of a MSGTYPE_TARGET frame and apply the target, without
+allocating a setpoint buffer or queueing the frame.
+
+@param comm The comm driver
+@param frame The frame with the message header
+@param c Checksum of the header
+@return RDY_OK if the target was applied, or RDY_RESET on error
+
+*/
+msg_t comm_lld_target(CommDriver *comm, const commframe_t *frame,
+                      crc16_t *c) {
+	const msgtype_header_t *header = &frame->header;
+	msgtype_target_t target;
+	msgtype_footer_t footer;
+
+	if (header->size != sizeof(target)) {
+		comm->stats.oversize++;
+		return RDY_RESET;
+	}
+	if (comm_lld_pull(comm, &target, sizeof(target), MS2ST(10), c) != sizeof(target) ||
+	    comm_lld_pull(comm, &footer, sizeof(footer), MS2ST(10), NULL) != sizeof(footer)) {
+		comm_lld_short(comm);
+		return RDY_RESET;
+	}
+
+	uint16_t crc16 = crc16Value(c);
+	if (crc16 != footer.crc16) {
+		comm->stats.crcerrors++;
+		return RDY_RESET;
+	}
+	comm->stats.frames++;
+
+	// a valid frame confirms a new bit rate
+	comm_lld_bitrate_verified(comm);
+
+	if (target.timeout == 0) {
+		target.timeout = MSGTYPE_TARGET_TIMEOUT_MS;
+	}
+	comm_lld_set_target(comm, frame->gen, target.setpoint, target.timeout);
+	return RDY_OK;
+}
+
 /*
 
-Receive master commands, ignoring messages not addressed to self.
+Check if a message type may be broadcast to all boards, i.e. boards do
+not respond to it, or respond in their own slots.
 
-@param chnp The comm channel
-@param header Pointer to header struct to save header data
-@param buf Buffer for data, should be at least 1KB
+@param type The message type, without flags
+@return true if the message type may be broadcast
 
 */
-msg_t comm_lld_receive(CommDriver *comm, msgtype_header_t *header,
-                       void **buf) {
+bool comm_lld_broadcastable(uint8_t type) {
+	switch (type) {
+	case MSGTYPE_MULTISETPOINT:
+	case MSGTYPE_SETPOINTAT:
+	case MSGTYPE_SYNC:
+	case MSGTYPE_POLL:
+	case MSGTYPE_BITRATE:
+	case MSGTYPE_SLEEP:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+
+Receive master commands, ignoring messages not addressed to self or
+to all boards, and broadcasts that boards would respond to.
+
+@param comm The comm driver
+@param frame Frame to save the header, data and receive time
+
+*/
+msg_t comm_lld_receive(CommDriver *comm, commframe_t *frame) {
 
-	BaseChannel *chnp = comm->config.io.chnp;
 	const size_t len = comm->config.object_size;
+	msgtype_header_t *header = &frame->header;
+	void **buf = &frame->buf;
 	*buf = NULL;
 	size_t n;
 
+	frame->sequenced = false;
+
 	for (;;) {
 
-		// read header
-		chSequentialStreamRead(chnp, &header->addr, 1);
+		// read header, waking up for a bit rate change
+		systime_t wait = comm_lld_bitrate(comm);
+		if (wait > COMM_RXPOLL_INTERVAL) {
+			wait = COMM_RXPOLL_INTERVAL;
+		}
+		crc16_t c;
+		crc16Reset(&c);
+		if (comm_lld_pull(comm, &header->addr, 1, wait, &c) != 1) {
+			continue;
+		}
+		frame->rxstart = motionCycles();
+		frame->gen = comm->abortgen;
 
 		// handle human-testable commands
 		switch (header->addr) {
@@ -75,56 +450,140 @@ msg_t comm_lld_receive(CommDriver *comm, msgtype_header_t *header,
 			return RDY_OK;
 		}
 
-		// ignore messages not addressed to self
-		if (!addrIsSelf(header->addr)) {
-			rs485Wait(comm->config.io.rsdp);
-			continue;
-		}
-
 		// read rest of header
 		uint8_t *bp = &header->type;
 		const size_t htlen = sizeof(*header) - sizeof(header->addr);
-		n = chnReadTimeout(chnp, bp, htlen, MS2ST(10));
+		n = comm_lld_pull(comm, bp, htlen, MS2ST(10), &c);
+
+		// take the frame version from the size
+		uint32_t hword;
+		memcpy(&hword, header, sizeof(hword));
+		const bool crc32 = (header->size & MSGTYPE_SIZE_CRC32) != 0;
+		const size_t tlen = crc32 ? sizeof(msgtype_footer32_t)
+		                          : sizeof(msgtype_footer_t);
+		header->size &= ~MSGTYPE_SIZE_CRC32;
+
+		// skip messages not addressed to self, broadcasts that would draw
+		// responses from all boards at once, or messages in a version not
+		// in use, by their length, falling back to waiting for an idle
+		// line if the header is unusable
+		const bool broadcast = header->addr == ADDR_BROADCAST &&
+		    comm_lld_broadcastable(header->type & ~MSGTYPE_SEQ);
+		if ((!addrIsSelf(header->addr) && !broadcast) ||
+		    (crc32 && comm->framing != MSGTYPE_FRAMING_V2)) {
+			comm->stats.foreign++;
+			const size_t skiplen = header->size + tlen;
+			if (n != htlen || header->size > len ||
+			    comm_lld_pull(comm, NULL, skiplen, S2ST(1), NULL) != skiplen) {
+#if COMM_USE_ADDRMARK
+				// the USART wakes on the next address mark for this board
+				rs485Mute(comm->config.io.rsdp);
+#else
+				rs485Wait(comm->config.io.rsdp);
+#endif
+			}
+			continue;
+		}
 
 		// check header and buffer should be large enough to hold data
-		if (n != htlen || header->size > len) {
+		if (n != htlen) {
+			comm_lld_short(comm);
 			goto error;
 		}
+		if (header->size > len) {
+			comm->stats.oversize++;
+			goto error;
+		}
+
+		// apply live targets right away
+		if (header->type == MSGTYPE_TARGET && !crc32) {
+			if (comm_lld_target(comm, frame, &c) != RDY_OK) {
+				goto error;
+			}
+			continue;
+		}
+
+		if (crc32) {
+			crc32hwReset();
+			crc32hwWord(hword);
+		}
 
 		// receive data
 		if (header->size) {
 			// allocate memory
 			*buf = chPoolAlloc(comm->config.pool);
 			if (*buf == NULL) {
+				comm->stats.poolempty++;
 				goto error;
 			}
+			motionInfoInit(*buf, header->size);
 			// read with a timeout long enough to accept all data
-			n = chnReadTimeout(chnp, *buf, header->size, S2ST(1));
+			comm->rxcrc32 = crc32;
+			n = comm_lld_pull(comm, *buf, header->size, S2ST(1), &c);
+			comm->rxcrc32 = false;
 			if (n != header->size) {
+				comm_lld_short(comm);
 				goto error;
 			}
+			// the last partial word is zero padded
+			const size_t tail = header->size & 3;
+			if (crc32 && tail > 0) {
+				uint32_t w = 0;
+				memcpy(&w, (uint8_t *)*buf + header->size - tail, tail);
+				crc32hwWord(w);
+			}
 		}
 
 		// read footer
-		msgtype_footer_t footer;
-		const size_t tlen = sizeof(msgtype_footer_t);
-		n = chnReadTimeout(chnp, (uint8_t *)&footer, tlen, MS2ST(10));
+		union {
+			msgtype_footer_t v1;
+			msgtype_footer32_t v2;
+		} footer;
+		n = comm_lld_pull(comm, &footer, tlen, MS2ST(10), NULL);
 		if (n != tlen) {
+			comm_lld_short(comm);
 			goto error;
 		}
+		frame->rxclock = motionClock(&MOTION2);
+		frame->rxtime = chTimeNow();
+		uint16_t crc16 = crc16Value(&c);
+		bool valid = crc32 ? crc32hwValue() == footer.v2.crc32
+		                   : crc16 == footer.v1.crc16;
+
+		// verify checksum; the header and sequence number of a corrupt
+		// frame cannot be trusted, so it is dropped without a response
+		if (!valid) {
+			comm->stats.crcerrors++;
+			goto error;
+		}
+		comm->stats.frames++;
+
+		// a valid frame confirms a new bit rate
+		comm_lld_bitrate_verified(comm);
 
-		// calculate checksum
-		crc16_t c;
-		crc16Reset(&c);
-		crc16UpdateN(&c, (uint8_t *)header, sizeof(*header));
 		if (*buf != NULL) {
-			crc16UpdateN(&c, *buf, header->size);
+			motionInfo(*buf)->stamps[MOTION_STAGE_RXSTART] = frame->rxstart;
+			motionStamp(*buf, MOTION_STAGE_RXEND);
 		}
-		uint16_t crc16 = crc16Value(&c);
 
-		// verify checksum
-		if (crc16 != footer.crc16) {
-			goto error;
+		// strip the sequence number from sequenced frames
+		if (header->type & MSGTYPE_SEQ) {
+			msgtype_seq_t seq;
+			if (header->size < sizeof(seq)) {
+				goto error;
+			}
+			memcpy(&seq, *buf, sizeof(seq));
+			header->type &= ~MSGTYPE_SEQ;
+			header->size -= sizeof(seq);
+			memmove(*buf, (uint8_t *)*buf + sizeof(seq), header->size);
+			motionInfo(*buf)->size = header->size;
+			if (header->size == 0) {
+				chPoolFree(comm->config.pool, *buf);
+				*buf = NULL;
+			}
+
+			frame->sequenced = true;
+			frame->seq = seq.seq;
 		}
 
 		// all ok
@@ -143,6 +602,169 @@ error:
 
 /*
 
+Move the slice addressed to this board to the start of the buffer of a
+broadcast message.
+
+@param header The message header
+@param buf The message data buffer
+@return Size of the slice, 0 if there is no slice for this board, or -1
+        if the message is malformed
+
+*/
+int32_t comm_lld_slice(const msgtype_header_t *header, void *buf) {
+	uint8_t *bp = buf;
+	size_t off = 0;
+
+	while (off + sizeof(msgtype_slice_t) <= header->size) {
+		msgtype_slice_t *slice = (msgtype_slice_t *)&bp[off];
+		size_t end = off + sizeof(*slice) + slice->size;
+		if (end > header->size) {
+			return -1;
+		}
+		if (addrIsSelf(slice->addr)) {
+			int32_t n = slice->size;
+			memmove(bp, slice->data, n);
+			return n;
+		}
+		off = end;
+	}
+
+	return off == header->size ? 0 : -1;
+}
+
+/*
+
+Post a setpoint buffer to the motion driver.
+
+@param comm The comm driver
+@param dp The setpoint buffer, set to NULL once posted
+@return RDY_OK if posted, RDY_TIMEOUT if the mailbox is full, or
+RDY_RESET if a line break stopped all motion since the frame was received
+
+*/
+msg_t comm_lld_post(CommDriver *comm, void **dp) {
+	motionStamp(*dp, MOTION_STAGE_POST);
+	chSysLock();
+	// drop setpoints received before a line break
+	if (comm->servicegen != comm->abortgen) {
+		chSysUnlock();
+		return RDY_RESET;
+	}
+	if (chMBPostI(comm->config.mbox, (msg_t)*dp) != RDY_OK) {
+		comm->stats.mboxfull++;
+		chSysUnlock();
+		return RDY_TIMEOUT;
+	}
+	chSysUnlock();
+	*dp = NULL;
+	return RDY_OK;
+}
+
+/*
+
+Take a snapshot of the motion and render state for telemetry. The motion
+driver thread has a higher priority and does not block during a tick, so
+with the system locked the state is always that between two ticks.
+
+@param t The telemetry record to fill
+
+*/
+void comm_lld_telemetry(msgtype_telemetry_t *t) {
+	MotionDriver *mdp = &MOTION2;
+	bool pid = !addrIsPurr();
+
+	chSysLock();
+	t->clock = motionClock(mdp);
+	t->position = pid ? pidrdValue(&PIDRENDER1) : 0;
+	t->error = pid ? PIDRENDER1.pid.lasterr : 0;
+	t->integral = pid ? PIDRENDER1.pid.integral : 0;
+	t->setpoint = mdp->rendered;
+	t->spindex = mdp->spindex;
+	t->loop = mdp->loop;
+	t->pwm = motorGetI();
+	t->flags = (mdp->active ? MSGTYPE_TELEMETRY_ACTIVE : 0) |
+	           (mdp->targetleft > 0 ? MSGTYPE_TELEMETRY_TARGET : 0) |
+	           (mdp->underrun ? MSGTYPE_TELEMETRY_UNDERRUN : 0);
+	chSysUnlock();
+}
+
+/*
+
+Count the free buffers of a memory pool. Must be called with the system
+locked.
+
+@param mp The memory pool
+@return Number of free buffers
+
+*/
+cnt_t comm_lld_pool_free(MemoryPool *mp) {
+	struct pool_header *php;
+	cnt_t n = 0;
+	for (php = mp->mp_next; php != NULL; php = php->ph_next) {
+		n++;
+	}
+	return n;
+}
+
+/*
+
+Get the shortest poll response slot, which fits a MSGTYPE_STATUS frame at
+the current bit rate and the jitter between boards.
+
+@param comm The comm driver
+@return Slot length in system ticks
+
+*/
+systime_t comm_lld_poll_slot(CommDriver *comm) {
+	RS485Driver *rsp = comm->config.io.rsdp;
+	size_t n = sizeof(msgtype_header_t) + sizeof(msgtype_status_t) +
+	           (comm->framing == MSGTYPE_FRAMING_V2 ?
+	            sizeof(msgtype_footer32_t) : sizeof(msgtype_footer_t));
+	// an idle frame and the data, with up to 11 bits per byte
+	uint32_t us = (uint64_t)(n + 1) * 11 * 1000000 / rsp->config.speed;
+	return MS2ST((us + 999) / 1000) + COMM_POLL_JITTER;
+}
+
+/*
+
+Collect the bus health counters of the comm and RS-485 drivers.
+
+@param comm The comm driver
+@param data The bus health record to fill
+@param reset Reset the counters after reading them
+
+*/
+void comm_lld_health(CommDriver *comm, msgtype_healthdata_t *data,
+                     bool reset) {
+	rs485stats_t rs;
+	rs485GetStats(comm->config.io.rsdp, &rs, reset);
+
+	chSysLock();
+	commstats_t cs = comm->stats;
+	if (reset) {
+		memset(&comm->stats, 0, sizeof(comm->stats));
+	}
+	chSysUnlock();
+
+	data->bytes = rs.bytes;
+	data->frames = cs.frames;
+	data->foreign = cs.foreign;
+	data->timeouts = cs.timeouts;
+	data->crcerrors = cs.crcerrors;
+	data->oversize = cs.oversize;
+	data->poolempty = cs.poolempty;
+	data->mboxfull = cs.mboxfull;
+	data->framing = rs.framing;
+	data->noise = rs.noise;
+	data->parity = rs.parity;
+	data->overrun = rs.overrun;
+	data->breaks = rs.breaks;
+	data->turnaround = rs.turnaround;
+	data->turnaroundmax = rs.turnaroundmax;
+}
+
+/*
+
 Service messages from master.
 
 The following human-testable commands are implemented:
@@ -154,45 +776,29 @@ The following human-testable commands are implemented:
 The commands, when not addressed via an envelope, will only work with
 one actuator connected to the RS-485 bus.
 
-@param chnp The comm channel
-@param header The message header
-@param dp The message data buffer
+@param comm The comm driver
+@param frame The received frame
 
 */
-msg_t comm_lld_service(CommDriver *comm,
-                       const msgtype_header_t *header,
-                       void **dp) {
+msg_t comm_lld_service(CommDriver *comm, commframe_t *frame) {
 
-	BaseSequentialStream *chp = comm->config.io.chp;
+	RS485Driver *rsp = comm->config.io.rsdp;
+	const msgtype_header_t *header = &frame->header;
+	void **dp = &frame->buf;
 
 	switch (header->type) {
 
 	// human-testable commands
 
-	case MSGTYPE_SLEEP: {
-		if (*dp == NULL) {
-			*dp = chPoolAlloc(comm->config.pool);
-		}
-
-		msgtype_setpoint_t *sb = *dp;
-		sb->delay = 0;
-		sb->loop = 0;
-		sb->n = 1;
-		sb->setpoints[0].duration = 0;
-		sb->setpoints[0].setpoint = 0;
-
-		// post stop message
-		chMBReset(comm->config.mbox);
-		if (chMBPost(comm->config.mbox, (msg_t)*dp, TIME_IMMEDIATE) == RDY_OK) {
-			*dp = NULL;
-		}
-
+	case MSGTYPE_SLEEP:
+		motionAbort(&MOTION2);
 		break;
-	}
 
-	case MSGTYPE_PING:
-		chprintf(chp, "%c\r\n", MSGTYPE_PONG);
+	case MSGTYPE_PING: {
+		static const uint8_t pong[] = {MSGTYPE_PONG, '\r', '\n'};
+		rs485Send(rsp, pong, sizeof(pong));
 		break;
+	}
 
 	case MSGTYPE_TEST:
 		commtestAll(comm);
@@ -203,8 +809,17 @@ msg_t comm_lld_service(CommDriver *comm,
 		if (!addrIsPurr()) {
 			p = pidrdValue(&PIDRENDER1);
 		}
-		chprintf(chp, "%d.%03d\r\n", (int)(p),
+		rs485txbuf_t *tbp = rs485TxAlloc(rsp);
+		if (tbp == NULL) {
+			return RDY_TIMEOUT;
+		}
+		// format into the transmit buffer
+		MemoryStream ms;
+		msObjectInit(&ms, tbp->data, sizeof(tbp->data), 0);
+		chprintf((BaseSequentialStream *)&ms, "%d.%03d\r\n", (int)(p),
 		         (int)(1000 * fmod(copysign(p, 1.0), 1.0)));
+		tbp->n = ms.eos;
+		rs485TxPost(rsp, tbp);
 		break;
 	}
 
@@ -224,46 +839,328 @@ msg_t comm_lld_service(CommDriver *comm,
 		if (*dp == NULL) {
 			return RDY_RESET;
 		}
-		if (chMBPost(comm->config.mbox, (msg_t)*dp, TIME_IMMEDIATE) == RDY_OK) {
-			*dp = NULL;
+		return comm_lld_post(comm, dp);
+
+	case MSGTYPE_SETPOINTDELTA:
+		if (*dp == NULL || !motionCheckDelta(*dp, header->size)) {
+			return RDY_RESET;
 		}
-		break;
+		motionInfo(*dp)->format = MOTION_FORMAT_DELTA;
+		return comm_lld_post(comm, dp);
+
+	case MSGTYPE_MULTISETPOINT: {
+		if (*dp == NULL) {
+			return RDY_RESET;
+		}
+
+		// extract setpoints for this board
+		int32_t n = comm_lld_slice(header, *dp);
+		if (n == 0) {
+			break;
+		}
+		msgtype_setpoint_t *sb = *dp;
+		if (n < (int32_t)sizeof(*sb) ||
+		    n < (int32_t)(sizeof(*sb) + sb->n * sizeof(sb->setpoints[0]))) {
+			return RDY_RESET;
+		}
+		motionInfo(sb)->size = n;
+
+		return comm_lld_post(comm, dp);
+	}
 
-// Newly implemented smooth command. Converts smooth command into a set of uni-directional setpoint commands at equal intervals
-// Problems with the algorithm, if there are, is most likely in the "currsetpt" conversion after the value of the current position
-// 	is read out with "pidrdValue".
-	
 	case MSGTYPE_SMOOTH: {
-		if (*dp == NULL || addrIsPurr()) {
+		msgtype_smooth_t *sm = *dp;
+		if (sm == NULL || header->size < offsetof(msgtype_smooth_t, profile)) {
+			return RDY_RESET;
+		}
+
+		// optional fields default to zero
+		uint16_t time = sm->time;
+		msgtype_spvalue_t target = sm->target;
+		uint8_t profile = MSGTYPE_PROFILE_LINEAR;
+		uint8_t flags = 0;
+		uint16_t start = 0;
+		if (header->size > offsetof(msgtype_smooth_t, profile)) {
+			profile = sm->profile;
+		}
+		if (header->size > offsetof(msgtype_smooth_t, flags)) {
+			flags = sm->flags;
+		}
+		if (profile > MSGTYPE_PROFILE_CUBIC) {
 			return RDY_RESET;
 		}
 
-		msgtype_smooth_t *instructs = *dp;
-		float curr_pos = pidrdValue(&PIDRENDER1);
-		int32_t currsetpt = (int32_t) ( (float)0xffff * (curr_pos/motorHiBound()-0.05)/0.9 );
+		if (flags & MSGTYPE_SMOOTH_START) {
+			if (header->size < sizeof(*sm)) {
+				return RDY_RESET;
+			}
+			start = sm->start;
+		} else if (addrIsPurr()) {
+			return RDY_RESET;
+		} else {
+			// start at the current position if the motor is idle
+			float pos = pidrdValue(&PIDRENDER1);
+			float x = (float)0xffff * (pos / motorHiBound() - 0.05) / 0.9;
+			start = x < 0 ? 0 : x > 0xffff ? 0xffff : (uint16_t)x;
+		}
 
-		msgtype_setpoint_t *interval_setpoints = NULL;
-		interval_setpoints = chPoolAlloc(comm->config.pool);
-		interval_setpoints->delay = 0;
-		interval_setpoints->loop = 1;
-		uint16_t n = (uint16_t)floor(instructs->time / SMOOTH_MININTERVAL_MS);
-		interval_setpoints->n = n+1;
-		int32_t setpt_diffs = (int32_t)floor(((int32_t)instructs->setpoints->setpoint - currsetpt)/(int32_t)n);
+		// rewrite the message in place as a smooth move
+		motionprofile_t *mp = *dp;
+		mp->delay = 0;
+		mp->loop = 1;
+		mp->n = 2;
+		mp->setpoints[0].duration = time;
+		mp->setpoints[0].setpoint = start;
+		mp->setpoints[1] = target;
+		mp->profile = profile;
+		mp->flags = (flags & MSGTYPE_SMOOTH_START) ? 0 : MOTION_PROFILE_CURRENT;
+		motionInfo(mp)->size = sizeof(*mp);
+		motionInfo(mp)->format = MOTION_FORMAT_PROFILE;
+		return comm_lld_post(comm, dp);
+	}
 
-		uint16_t i;
-		for (i=0; i<n-1; i++) {
-			interval_setpoints->setpoints[i].duration = SMOOTH_MININTERVAL_MS;
-			interval_setpoints->setpoints[i].setpoint = (uint16_t)(currsetpt+(i+1)*setpt_diffs);
+	case MSGTYPE_WAVE: {
+		msgtype_wave_t *wave = *dp;
+		if (wave == NULL || header->size < sizeof(*wave) ||
+		    wave->shape > MSGTYPE_WAVE_BREATHE || wave->period == 0 ||
+		    wave->count == 0) {
+			return RDY_RESET;
 		}
-		interval_setpoints->setpoints[n].duration = instructs->setpoints->duration;
-		interval_setpoints->setpoints[n].setpoint = instructs->setpoints->setpoint;
-		
-		if (chMBPost(comm->config.mbox, (msg_t)interval_setpoints, TIME_IMMEDIATE) == RDY_OK) {
-			*dp = NULL;
+
+		// rewrite the message in place as a waveform
+		msgtype_wave_t w = *wave;
+		motionwave_t *wp = *dp;
+		wp->delay = 0;
+		wp->loop = w.count;
+		wp->n = 1;
+		wp->setpoints[0].duration = w.period;
+		wp->setpoints[0].setpoint = w.center;
+		wp->shape = w.shape;
+		wp->reserved = 0;
+		wp->amplitude = w.amplitude;
+		wp->phase = w.phase;
+		motionInfo(wp)->size = sizeof(*wp);
+		motionInfo(wp)->format = MOTION_FORMAT_WAVE;
+		return comm_lld_post(comm, dp);
+	}
+
+	case MSGTYPE_SETPOINTAT: {
+		msgtype_setpointat_t *at = *dp;
+		if (at == NULL || header->size < sizeof(*at) ||
+		    header->size < sizeof(*at) + at->sp.n * sizeof(msgtype_spvalue_t)) {
+			return RDY_RESET;
+		}
+
+		// move setpoints to the start of the buffer
+		motioninfo_t *info = motionInfo(at);
+		info->start = at->start;
+		info->size = header->size - sizeof(at->start);
+		info->startmode = MOTION_START_AT;
+		memmove(*dp, &at->sp, info->size);
+
+		return comm_lld_post(comm, dp);
+	}
+
+	case MSGTYPE_KEYFRAME: {
+		msgtype_keyframe_t *kf = *dp;
+		if (kf == NULL || header->size < sizeof(*kf) ||
+		    header->size < sizeof(*kf) + kf->sp.n * sizeof(msgtype_spvalue_t) ||
+		    kf->interp > MSGTYPE_INTERP_CUBIC) {
+			return RDY_RESET;
 		}
+
+		// move setpoints to the start of the buffer
+		motioninfo_t *info = motionInfo(kf);
+		info->interp = kf->interp;
+		info->size = header->size - offsetof(msgtype_keyframe_t, sp);
+		memmove(*dp, &kf->sp, info->size);
+
+		return comm_lld_post(comm, dp);
+	}
+
+	case MSGTYPE_SYNC: {
+		msgtype_sync_t *sync = *dp;
+		if (sync == NULL || header->size < sizeof(*sync)) {
+			return RDY_RESET;
+		}
+		motionSync(&MOTION2, sync->time, frame->rxclock);
 		break;
 	}
 
+	case MSGTYPE_POLL: {
+		msgtype_poll_t *poll = *dp;
+		systime_t slot = comm_lld_poll_slot(comm);
+		if (poll != NULL && header->size >= sizeof(*poll)) {
+			if (MS2ST(poll->slot) < slot) {
+				return RDY_RESET;
+			}
+			slot = MS2ST(poll->slot);
+		}
+		if (addrSlot() < 0) {
+			return RDY_RESET;
+		}
+
+		msgtype_status_t status = {0, motorGetI()};
+		if (!addrIsPurr()) {
+			status.position = pidrdValue(&PIDRENDER1);
+		}
+
+		rs485txbuf_t *tbp = rs485TxAlloc(rsp);
+		if (tbp == NULL) {
+			return RDY_TIMEOUT;
+		}
+		// respond in the slot for this board
+		comm_lld_frame(comm, tbp, MSGTYPE_STATUS, &status, sizeof(status));
+		rs485TxPostAt(rsp, tbp, frame->rxtime + addrSlot() * slot);
+		break;
+	}
+
+	case MSGTYPE_BUNDLE:
+		return comm_lld_bundle(comm, frame);
+
+	case MSGTYPE_TARGET: {
+		msgtype_target_t *target = *dp;
+		if (target == NULL || header->size < sizeof(*target)) {
+			return RDY_RESET;
+		}
+		comm_lld_set_target(comm, comm->servicegen, target->setpoint,
+		                    target->timeout != 0 ?
+		                    target->timeout : MSGTYPE_TARGET_TIMEOUT_MS);
+		break;
+	}
+
+	case MSGTYPE_FRAMING: {
+		msgtype_framing_t *framing = *dp;
+		if (framing == NULL || header->size < sizeof(*framing) ||
+		    (framing->version != MSGTYPE_FRAMING_V1 &&
+		     framing->version != MSGTYPE_FRAMING_V2)) {
+			return RDY_RESET;
+		}
+		rs485txbuf_t *tbp = rs485TxAlloc(rsp);
+		if (tbp == NULL) {
+			return RDY_TIMEOUT;
+		}
+		// confirm in the old version, then switch
+		comm_lld_frame(comm, tbp, MSGTYPE_FRAMING, framing, sizeof(*framing));
+		rs485TxPost(rsp, tbp);
+		comm->framing = framing->version;
+		break;
+	}
+
+	case MSGTYPE_UNDERRUN: {
+		msgtype_underrun_t *ur = *dp;
+		if (ur == NULL || header->size < sizeof(*ur) ||
+		    ur->policy > MOTION_UNDERRUN_EXTRAPOLATE) {
+			return RDY_RESET;
+		}
+		motionSetUnderrun(&MOTION2, ur->policy, ur->time);
+		break;
+	}
+
+	case MSGTYPE_LATENCY: {
+		msgtype_latency_t *lat = *dp;
+		bool reset = lat != NULL && header->size >= sizeof(*lat) &&
+		             (lat->flags & MSGTYPE_LATENCY_RESET);
+
+		rs485txbuf_t *tbp = rs485TxAlloc(rsp);
+		if (tbp == NULL) {
+			return RDY_TIMEOUT;
+		}
+		msgtype_latencydata_t data;
+		motionGetLatency(&MOTION2, &data.counts[0][0], reset);
+		comm_lld_frame(comm, tbp, MSGTYPE_LATENCYDATA, &data, sizeof(data));
+		rs485TxPost(rsp, tbp);
+		break;
+	}
+
+	case MSGTYPE_HEALTH: {
+		msgtype_health_t *health = *dp;
+		bool reset = health != NULL && header->size >= sizeof(*health) &&
+		             (health->flags & MSGTYPE_HEALTH_RESET);
+
+		rs485txbuf_t *tbp = rs485TxAlloc(rsp);
+		if (tbp == NULL) {
+			return RDY_TIMEOUT;
+		}
+		msgtype_healthdata_t data;
+		comm_lld_health(comm, &data, reset);
+		comm_lld_frame(comm, tbp, MSGTYPE_HEALTHDATA, &data, sizeof(data));
+		rs485TxPost(rsp, tbp);
+		break;
+	}
+
+	case MSGTYPE_TELEMETRY: {
+		msgtype_telemetry_t t;
+		comm_lld_telemetry(&t);
+
+		rs485txbuf_t *tbp = rs485TxAlloc(rsp);
+		if (tbp == NULL) {
+			return RDY_TIMEOUT;
+		}
+		comm_lld_frame(comm, tbp, MSGTYPE_TELEMETRYDATA, &t, sizeof(t));
+		rs485TxPost(rsp, tbp);
+		break;
+	}
+
+	case MSGTYPE_BITRATE: {
+		msgtype_bitrate_t *br = *dp;
+		if (br == NULL || header->size < sizeof(*br) ||
+		    br->speed == 0 || br->speed > RS485_MAX_BITRATE) {
+			return RDY_RESET;
+		}
+		// the receive thread switches once the change is pending
+		chSysLock();
+		comm->brspeed = br->speed;
+		comm->brtime = frame->rxtime + MS2ST(br->delay);
+		comm->brstate = COMM_BITRATE_PENDING;
+		chSysUnlock();
+		break;
+	}
+
+	case MSGTYPE_STREAM: {
+		msgtype_stream_t *chunk = *dp;
+		if (chunk == NULL || header->size < sizeof(*chunk) ||
+		    header->size < sizeof(*chunk) +
+		                   chunk->sp.n * sizeof(msgtype_spvalue_t)) {
+			return RDY_RESET;
+		}
+
+		if (chunk->flags & MSGTYPE_STREAM_FIRST) {
+			comm->streamseq = chunk->seq;
+		}
+
+		// queue chunk if in sequence
+		if (chunk->seq == comm->streamseq) {
+			motioninfo_t *info = motionInfo(chunk);
+			info->size = header->size - offsetof(msgtype_stream_t, sp);
+			info->startmode = MOTION_START_APPEND;
+			memmove(*dp, &chunk->sp, info->size);
+			if (comm_lld_post(comm, dp) == RDY_OK) {
+				comm->streamseq++;
+			}
+		}
+
+		// return credit for chunks that fit both the mailbox and the pool
+		msgtype_credit_t credit = {comm->streamseq, 0};
+		chSysLock();
+		cnt_t free = chMBGetFreeCountI(comm->config.mbox);
+		cnt_t blocks = comm_lld_pool_free(comm->config.pool);
+		chSysUnlock();
+		if (blocks < free) {
+			free = blocks;
+		}
+		if (free > COMM_STREAM_RESERVE) {
+			credit.credit = free - COMM_STREAM_RESERVE;
+		}
+
+		rs485txbuf_t *tbp = rs485TxAlloc(rsp);
+		if (tbp == NULL) {
+			return RDY_TIMEOUT;
+		}
+		comm_lld_frame(comm, tbp, MSGTYPE_CREDIT, &credit, sizeof(credit));
+		rs485TxPost(rsp, tbp);
+		break;
+	}
 
 	// invalid commands
 
@@ -274,19 +1171,137 @@ msg_t comm_lld_service(CommDriver *comm,
 	return RDY_OK;
 }
 
+/*
+
+Service the sub-commands of a bundle message in order. The last
+sub-command is moved to the start of the bundle buffer, and the others
+are copied to buffers of their own, so that sub-commands that queue
+setpoints can keep their buffer.
+
+@param comm The comm driver
+@param frame The received bundle frame
+@return RDY_OK if all sub-commands were serviced, or the error of the
+        first that failed
+
+*/
+msg_t comm_lld_bundle(CommDriver *comm, commframe_t *frame) {
+	uint8_t *bp = frame->buf;
+	const size_t size = frame->header.size;
+	size_t off = 0;
+
+	if (bp == NULL) {
+		return RDY_RESET;
+	}
+
+	// sub-commands are timestamped like the bundle
+	uint32_t stamps[MOTION_STAGE_COUNT];
+	memcpy(stamps, motionInfo(bp)->stamps, sizeof(stamps));
+
+	// check all sub-commands before servicing any
+	while (off + sizeof(msgtype_subcmd_t) <= size) {
+		msgtype_subcmd_t *sub = (msgtype_subcmd_t *)&bp[off];
+		if (sub->type == MSGTYPE_BUNDLE) {
+			return RDY_RESET;
+		}
+		off += sizeof(*sub) + sub->size;
+	}
+	if (off != size) {
+		return RDY_RESET;
+	}
+
+	for (off = 0; off < size;) {
+		msgtype_subcmd_t *sub = (msgtype_subcmd_t *)&bp[off];
+		const size_t end = off + sizeof(*sub) + sub->size;
+
+		commframe_t subframe = *frame;
+		subframe.header.type = sub->type;
+		subframe.header.size = sub->size;
+		subframe.sequenced = false;
+		subframe.buf = NULL;
+
+		if (sub->size > 0) {
+			if (end == size) {
+				// take over the bundle buffer
+				memmove(bp, sub->data, sub->size);
+				subframe.buf = bp;
+				frame->buf = NULL;
+			} else {
+				subframe.buf = chPoolAlloc(comm->config.pool);
+				if (subframe.buf == NULL) {
+					return RDY_RESET;
+				}
+				memcpy(subframe.buf, sub->data, sub->size);
+			}
+			motionInfoInit(subframe.buf, sub->size);
+			memcpy(motionInfo(subframe.buf)->stamps, stamps, sizeof(stamps));
+		}
+
+		msg_t ret = comm_lld_service(comm, &subframe);
+		if (subframe.buf != NULL) {
+			chPoolFree(comm->config.pool, subframe.buf);
+		}
+		if (ret != RDY_OK) {
+			return ret;
+		}
+
+		off = end;
+	}
+
+	return RDY_OK;
+}
+
+/* Receive and validate frames to service. */
+static msg_t rx_thread(void *p) {
+	CommDriver *comm = p;
+	while (!chThdShouldTerminate()) {
+		chSemWait(&comm->rxfree);
+		commframe_t *frame = chPoolAlloc(&comm->rxpool);
+		// errors are queued too, to be reported by commHandle()
+		frame->status = comm_lld_receive(comm, frame);
+		chMBPost(&comm->rxmbox, (msg_t)frame, TIME_INFINITE);
+	}
+	return RDY_OK;
+}
+
 msg_t commHandle(CommDriver *comm) {
-	msgtype_header_t header;
-	void *buf = NULL;
-	msg_t ret = RDY_OK;
+	msg_t msg;
+
+	if (chMBFetch(&comm->rxmbox, &msg, TIME_INFINITE) != RDY_OK) {
+		return RDY_RESET;
+	}
+	commframe_t *frame = (commframe_t *)msg;
+	msg_t ret = frame->status;
 
-	ret = comm_lld_receive(comm, &header, &buf);
-	if (ret == RDY_OK) {
-		ret = comm_lld_service(comm, &header, &buf);
+	// drop frames received before a line break without a response
+	comm->servicegen = frame->gen;
+	if (ret == RDY_OK && frame->gen != comm->abortgen) {
+		ret = RDY_RESET;
+	} else if (ret == RDY_OK && frame->sequenced &&
+	    comm_lld_seq_seen(comm, frame->seq)) {
+		// acknowledge duplicates again without servicing them
+		if (addrIsSelf(frame->header.addr)) {
+			comm_lld_ack(comm, MSGTYPE_ACK, frame->seq);
+		}
+	} else if (ret == RDY_OK) {
+		ret = comm_lld_service(comm, frame);
+
+		// acknowledge sequenced frames addressed to self
+		if (frame->sequenced) {
+			if (ret == RDY_OK) {
+				comm_lld_seq_accept(comm, frame->seq);
+			}
+			if (addrIsSelf(frame->header.addr)) {
+				comm_lld_ack(comm, ret == RDY_OK ? MSGTYPE_ACK : MSGTYPE_NACK,
+				             frame->seq);
+			}
+		}
 	}
 
-	if (buf != NULL) {
-		chPoolFree(comm->config.pool, buf);
+	if (frame->buf != NULL) {
+		chPoolFree(comm->config.pool, frame->buf);
 	}
+	chPoolFree(&comm->rxpool, frame);
+	chSemSignal(&comm->rxfree);
 
 	return ret;
 }
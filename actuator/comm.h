@@ -20,6 +20,49 @@ Vancouver, B.C. V6T 1Z4 Canada
 #include "msgtype.h"
 #include "rs485.h"
 
+/*
+
+Filter frames addressed to other boards in hardware with USART
+address-mark wakeup. The master must then send 9-bit words, setting the
+ninth bit on the address byte of each frame only. Unaddressed
+human-testable commands are accepted only while the receiver is awake,
+and frames to ADDR_BROADCAST are not received.
+
+*/
+#if !defined(COMM_USE_ADDRMARK)
+#define COMM_USE_ADDRMARK               FALSE
+#endif
+
+/*
+
+Setpoint buffers kept out of stream credit: buffers held outside the
+mailbox by the motion driver, and pool buffers needed to receive other
+frames while a stream is in flight.
+
+*/
+#define COMM_STREAM_RESERVE             2
+
+/* Number of received frames that may wait to be serviced. */
+#define COMM_RXQUEUE_COUNT              3
+
+/* Receive thread working area size. */
+#define COMM_RXTHREAD_WA_SIZE           512
+
+/* Longest wait for a frame before checking for a bit rate change. */
+#define COMM_RXPOLL_INTERVAL            MS2ST(10)
+
+/*
+
+Scheduling jitter of poll responses between boards. Each board takes the
+receive time of the poll in whole system ticks and wakes to respond on a
+tick boundary, and the system ticks of the boards are not aligned.
+
+*/
+#define COMM_POLL_JITTER                2
+
+/* Number of recently accepted sequence numbers to detect duplicates. */
+#define COMM_SEQ_WINDOW                 32
+
 /* Communication driver states. */
 typedef enum {
   COMM_UNINIT = 0,
@@ -27,6 +70,13 @@ typedef enum {
   COMM_READY = 2
 } commstate_t;
 
+/* Bit rate change states. */
+typedef enum {
+  COMM_BITRATE_IDLE = 0,                // no change in progress
+  COMM_BITRATE_PENDING = 1,             // waiting to switch
+  COMM_BITRATE_VERIFY = 2               // waiting for a valid frame
+} commbitrate_t;
+
 /* Communication I/O types. */
 typedef union {
   BaseChannel *chnp;
@@ -34,6 +84,30 @@ typedef union {
   RS485Driver *rsdp;
 } commio_t;
 
+/* Bus health counters. */
+typedef struct {
+  uint32_t frames;                      // valid frames received
+  uint32_t foreign;                     // frames for other boards
+  uint32_t timeouts;                    // frames cut short by a timeout
+  uint32_t crcerrors;                   // checksum mismatches
+  uint32_t oversize;                    // headers with an invalid size
+  uint32_t poolempty;                   // frames dropped for lack of buffers
+  uint32_t mboxfull;                    // setpoints dropped by a full mailbox
+} commstats_t;
+
+/* Received frame, validated and waiting to be serviced. */
+typedef struct {
+  msg_t status;                         // receive status
+  msgtype_header_t header;              // message header
+  void *buf;                            // message data, or NULL
+  uint32_t rxstart;                     // cycle counter at first byte
+  uint32_t gen;                         // line breaks before first byte
+  uint32_t rxclock;                     // motion clock at end of frame
+  systime_t rxtime;                     // system time at end of frame
+  bool sequenced;                       // frame is sequenced
+  uint16_t seq;                         // sequence number
+} commframe_t;
+
 /* Communication driver configuration. */
 typedef struct {
   MemoryPool *pool;                     // setpoint memory pool
@@ -46,6 +120,27 @@ typedef struct {
 typedef struct {
   commstate_t state;                    // driver state
   CommConfig config;                    // configuration
+  uint16_t streamseq;                   // next expected stream chunk
+  uint16_t seqlast;                     // newest accepted sequence number
+  uint32_t seqseen;                     // accepted sequence number window
+  uint8_t framing;                      // frame version
+  bool rxcrc32;                         // feed received data to CRC unit
+  commstats_t stats;                    // bus health counters
+  /* Bit rate change, shared with the receive thread under lock. */
+  commbitrate_t brstate;                // bit rate change state
+  uint32_t brspeed;                     // bit rate to switch to
+  systime_t brtime;                     // time to switch or fall back
+  /* Line break abort. */
+  volatile uint32_t abortgen;           // line breaks so far
+  uint32_t servicegen;                  // gen of the frame being serviced
+  /* Receive queue. */
+  Semaphore rxfree;                     // free frames
+  MemoryPool rxpool;                    // frame allocator
+  Mailbox rxmbox;                       // frames to service
+  msg_t rxmbox_buf[COMM_RXQUEUE_COUNT];
+  commframe_t rxframes[COMM_RXQUEUE_COUNT];
+  WORKING_AREA(rxthread_wa, COMM_RXTHREAD_WA_SIZE);
+  Thread *rxthread_tp;                  // receive thread
 } CommDriver;
 
 extern CommDriver COMM1;
@@ -54,8 +149,26 @@ void commInit(void);
 
 void commObjectInit(CommDriver *comm);
 
+/*
+
+Start the comm driver. Frames are received and validated on a separate
+thread, so that the next frame is received while the current one is
+serviced by commHandle().
+
+@param comm The comm driver
+@param config The comm driver configuration
+
+*/
 void commStart(CommDriver *comm, CommConfig *config);
 
+/*
+
+Service the next received frame, waiting for one if none is queued.
+
+@param comm The comm driver
+@return RDY_OK if the frame was received and serviced without error
+
+*/
 msg_t commHandle(CommDriver *comm);
 
 #endif // _COMM_H_
@@ -16,6 +16,7 @@ Vancouver, B.C. V6T 1Z4 Canada
 #include "addr.h"
 #include "comm.h"
 #include "commtest.h"
+#include "motion.h"
 #include "render_ps.h"
 
 void commtestAll(CommDriver *comm) {
@@ -27,6 +28,7 @@ void commtestMotion(CommDriver *comm) {
 
 	sb = chPoolAlloc(comm->config.pool);
 	if (sb != NULL) {
+		motionInfoInit(sb, sizeof(*sb) + sizeof(sb->setpoints[0]));
 		sb->delay = 0;
 		sb->loop = MSGTYPE_LOOP_INFINITE;
 		sb->n = 1;
@@ -43,6 +45,7 @@ void commtestMotion(CommDriver *comm) {
 
 	sb = chPoolAlloc(comm->config.pool);
 	if (sb != NULL) {
+		motionInfoInit(sb, sizeof(*sb) + 2 * sizeof(sb->setpoints[0]));
 		sb->delay = 2000;
 		sb->loop = 3;
 		sb->n = 2;
@@ -0,0 +1,59 @@
+/*
+
+Cuddlebot actuator firmware - Copyright (C) 2014 Michael Phan-Ba
+
+Property of SPIN Research Group
+ICICS/CS Building X508-2366 Main Mall
+Vancouver, B.C. V6T 1Z4 Canada
+(604) 822 8169 - maclean@cs.ubc.ca
+
+*/
+
+/*
+
+Reference implementation of the CRC-32 computed by the STM32 CRC unit,
+for use on the host and for small frames on the board.
+
+The CRC unit takes 32-bit words, most significant bit first, with
+polynomial 0x04c11db7, initial value 0xffffffff, and no final XOR. Data
+is taken as little endian words, as loaded by the CPU, and zero padded
+to a multiple of four bytes.
+
+Test vectors:
+
+  (empty)                     0xffffffff
+  00 00 00 00                 0xc704dd7b
+  "123456789"                 0xaff19057
+  00 01 02 ... ff             0xb7ec66f4
+
+*/
+
+#ifndef _CRC32_H_
+#define _CRC32_H_
+
+#include <stdint.h>
+#include <string.h>
+
+typedef struct {
+  uint32_t v;                           // checksum of whole words
+  uint32_t w;                           // partial word
+  uint8_t n;                            // bytes in partial word
+} crc32_t;
+
+void crc32Reset(crc32_t *c);
+
+void crc32Update(crc32_t *c, const uint8_t v);
+
+void crc32UpdateN(crc32_t *c, const uint8_t *buf, const size_t n);
+
+/*
+
+Get the checksum, zero padding a partial word.
+
+@param c The checksum
+@return The checksum value
+
+*/
+uint32_t crc32Value(const crc32_t *c);
+
+#endif // _CRC32_H_
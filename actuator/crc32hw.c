@@ -0,0 +1,70 @@
+/*
+
+Cuddlebot actuator firmware - Copyright (C) 2014 Michael Phan-Ba
+
+Property of SPIN Research Group
+ICICS/CS Building X508-2366 Main Mall
+Vancouver, B.C. V6T 1Z4 Canada
+(604) 822 8169 - maclean@cs.ubc.ca
+
+*/
+
+#include <ch.h>
+#include <hal.h>
+
+#include "crc32hw.h"
+
+static const stm32_dma_stream_t *dmastp;
+
+/* Wait for the DMA to finish feeding the CRC unit. */
+static void crc32hw_lld_wait(void) {
+	while (dmastp->stream->CR & STM32_DMA_CR_EN) {
+		// a block takes 1 us per 40 words at most
+	}
+}
+
+void crc32hwInit(void) {
+	rccEnableAHB1(RCC_AHB1ENR_CRCEN, FALSE);
+	dmastp = STM32_DMA_STREAM(CRC32HW_DMA_STREAM);
+	dmaStreamAllocate(dmastp, CRC32HW_DMA_IRQ_PRIORITY, NULL, NULL);
+	// fixed destination, the CRC data register
+	dmaStreamSetMemory0(dmastp, &CRC->DR);
+}
+
+void crc32hwReset(void) {
+	crc32hw_lld_wait();
+	CRC->CR = CRC_CR_RESET;
+}
+
+void crc32hwWord(uint32_t w) {
+	crc32hw_lld_wait();
+	CRC->DR = w;
+}
+
+void crc32hwFeed(const void *bp, size_t n) {
+	const uint32_t *wp = bp;
+	size_t i;
+
+	crc32hw_lld_wait();
+
+	if (n < CRC32HW_DMA_MIN_WORDS) {
+		for (i = 0; i < n; i++) {
+			CRC->DR = wp[i];
+		}
+		return;
+	}
+
+	// in memory-to-memory mode the peripheral port is the source
+	dmaStreamClearInterrupt(dmastp);
+	dmaStreamSetPeripheral(dmastp, bp);
+	dmaStreamSetTransactionSize(dmastp, n);
+	dmaStreamSetMode(dmastp, STM32_DMA_CR_DIR_M2M | STM32_DMA_CR_PINC |
+	                 STM32_DMA_CR_PSIZE_WORD | STM32_DMA_CR_MSIZE_WORD |
+	                 STM32_DMA_CR_PL(CRC32HW_DMA_PRIORITY));
+	dmaStreamEnable(dmastp);
+}
+
+uint32_t crc32hwValue(void) {
+	crc32hw_lld_wait();
+	return CRC->DR;
+}
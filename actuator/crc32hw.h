@@ -0,0 +1,75 @@
+/*
+
+Cuddlebot actuator firmware - Copyright (C) 2014 Michael Phan-Ba
+
+Property of SPIN Research Group
+ICICS/CS Building X508-2366 Main Mall
+Vancouver, B.C. V6T 1Z4 Canada
+(604) 822 8169 - maclean@cs.ubc.ca
+
+*/
+
+/*
+
+CRC-32 computed by the STM32 CRC unit, fed by the CPU or by DMA, see
+crc32.h for the reference implementation. Not thread safe.
+
+*/
+
+#ifndef _CRC32HW_H_
+#define _CRC32HW_H_
+
+#include <ch.h>
+#include <hal.h>
+
+/* DMA stream to feed the CRC unit, must support memory-to-memory. */
+#if !defined(CRC32HW_DMA_STREAM)
+#define CRC32HW_DMA_STREAM              STM32_DMA_STREAM_ID(2, 6)
+#endif
+
+/* DMA stream priority. */
+#define CRC32HW_DMA_PRIORITY            0
+
+/* DMA stream interrupt priority, unused as the stream is polled. */
+#define CRC32HW_DMA_IRQ_PRIORITY        12
+
+/* Blocks shorter than this, in words, are fed by the CPU. */
+#define CRC32HW_DMA_MIN_WORDS           8
+
+/* Enable the CRC unit and allocate the DMA stream. */
+void crc32hwInit(void);
+
+/* Reset the checksum, waiting for data being fed by DMA. */
+void crc32hwReset(void);
+
+/*
+
+Update the checksum with a word, waiting for data being fed by DMA.
+
+@param w The word
+
+*/
+void crc32hwWord(uint32_t w);
+
+/*
+
+Start feeding a block of words to the CRC unit, by DMA for longer
+blocks, without waiting for the block to be done. The block must stay
+valid until the next call.
+
+@param bp The block, word aligned and in DMA accessible memory
+@param n Number of words
+
+*/
+void crc32hwFeed(const void *bp, size_t n);
+
+/*
+
+Get the checksum, waiting for data being fed by DMA.
+
+@return The checksum value
+
+*/
+uint32_t crc32hwValue(void);
+
+#endif // _CRC32HW_H_
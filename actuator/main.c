@@ -42,14 +42,24 @@ limitations under the License.
 #include "render_ps.h"
 #include "rs485.h"
 
-#define SETPOINT_BUF_SIZE               1024
+#define SETPOINT_BUF_SIZE               MOTION_SPBUF_SIZE
 #define SETPOINT_BUF_COUNT              8
 
-static uint8_t sp_memory_buf[SETPOINT_BUF_COUNT *SETPOINT_BUF_SIZE];
+/*
+
+Motion driver thread stack size. The deepest call chain evaluates a
+waveform with sinf() or cosf(), whose argument reduction in newlib keeps
+about 320 bytes of arrays on the stack. Check with -fstack-usage.
+
+*/
+#define SETPOINT_THREAD_WA_SIZE         1024
+
+static uint8_t sp_memory_buf[SETPOINT_BUF_COUNT *SETPOINT_BUF_SIZE]
+  __attribute__((aligned(4)));
 static msg_t sp_mailbox_buf[SETPOINT_BUF_COUNT];
 static MEMORYPOOL_DECL(sp_memory_pool, SETPOINT_BUF_SIZE, NULL);
 static MAILBOX_DECL(sp_mailbox, sp_mailbox_buf, SETPOINT_BUF_COUNT);
-static WORKING_AREA(sp_thread_wa, 128);
+static WORKING_AREA(sp_thread_wa, SETPOINT_THREAD_WA_SIZE);
 
 PIDConfig pidcfg = {
 	.kp = 100.0,
@@ -70,7 +80,7 @@ MotionConfig motioncfg = {
 CommConfig commcfg = {
 	.pool = &sp_memory_pool,
 	.mbox = &sp_mailbox,
-	.object_size = SETPOINT_BUF_SIZE,
+	.object_size = MOTION_SPDATA_SIZE,
 	.io = { .rsdp = &RSD3 }
 };
 
@@ -139,10 +149,6 @@ int main(void) {
 	rs485Init();
 	rs485Start(&RSD3);
 
-	// start comm driver
-	commInit();
-	commStart(&COMM1, &commcfg);
-
 	// typed channels
 	BaseChannel *chnp = (BaseChannel *)&RSD3;
 	// BaseSequentialStream *chp = (BaseSequentialStream *)&RSD3;
@@ -155,6 +161,10 @@ int main(void) {
 	// ignore anomalous '\0' char
 	chnGetTimeout(chnp, MS2ST(1));
 
+	// start comm driver
+	commInit();
+	commStart(&COMM1, &commcfg);
+
 	for (;;) {
 		// handle commands
 		if (commHandle(&COMM1) < RDY_OK) {
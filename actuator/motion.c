@@ -9,6 +9,9 @@ Vancouver, B.C. V6T 1Z4 Canada
 
 */
 
+#include <math.h>
+#include <string.h>
+
 #include <ch.h>
 #include <hal.h>
 
@@ -22,6 +25,15 @@ MotionDriver MOTION2;
 void gpt_callback(GPTDriver *gptp) {
 	if (gptp == &GPTD2) {
 		chSysLockFromIsr();
+		// advance the clock, slewing out clock error
+		if (MOTION2.slew > 0) {
+			MOTION2.clock += 2;
+			MOTION2.slew--;
+		} else if (MOTION2.slew < 0) {
+			MOTION2.slew++;
+		} else {
+			MOTION2.clock++;
+		}
 		chBSemSignalI(&MOTION2.ready);
 		chSysUnlockFromIsr();
 	}
@@ -49,11 +61,246 @@ void motion_lld_free_sp_if_empty(MotionDriver *mdp) {
 	}
 }
 
+/*
+
+Decode a varint.
+
+@param bp The coded data
+@param vp Pointer to save the value
+@return Number of bytes decoded
+
+*/
+size_t motion_lld_varint(const uint8_t *bp, uint32_t *vp) {
+	size_t i = 0;
+	uint32_t v = 0;
+	do {
+		v |= (uint32_t)(bp[i] & 0x7f) << (7 * i);
+	} while ((bp[i++] & 0x80) && i < MOTION_VARINT_MAX);
+	*vp = v;
+	return i;
+}
+
 void motion_lld_load_sp_data(MotionDriver *mdp) {
-	if (mdp->sp != NULL) {
+	if (mdp->sp == NULL) {
+		return;
+	}
+
+	switch (motionInfo(mdp->sp)->format) {
+
+	case MOTION_FORMAT_DELTA: {
+		const msgtype_setpointdelta_t *dsp = (void *)mdp->sp;
+		uint32_t duration, zz;
+		// start from the first setpoint
+		if (mdp->spindex == 0) {
+			mdp->spoffset = 0;
+			mdp->setpoint = 0;
+		}
+		// decode next setpoint
+		mdp->spoffset += motion_lld_varint(&dsp->data[mdp->spoffset], &duration);
+		mdp->spoffset += motion_lld_varint(&dsp->data[mdp->spoffset], &zz);
+		mdp->duration = duration;
+		mdp->setpoint += (uint16_t)((zz >> 1) ^ -(zz & 1));
+		break;
+	}
+
+	default: {
 		msgtype_spvalue_t *spp = &mdp->sp->setpoints[mdp->spindex];
 		mdp->duration = spp->duration;
 		mdp->setpoint = spp->setpoint;
+		break;
+	}
+
+	}
+	mdp->spduration = mdp->duration;
+}
+
+/*
+
+Evaluate a smooth move profile.
+
+@param profile The profile, MOTION_PROFILE_*
+@param s Fraction of the move time elapsed, from 0 to 1
+@return Fraction of the distance moved, from 0 to 1
+
+*/
+float motion_lld_profile(uint8_t profile, float s) {
+	switch (profile) {
+	case MOTION_PROFILE_MINJERK:
+		return s * s * s * (10.0f + s * (-15.0f + s * 6.0f));
+	case MOTION_PROFILE_TRAPEZOID: {
+		// constant acceleration ramps around a constant velocity cruise
+		const float a = 1.0f / MOTION_TRAPEZOID_RAMP;
+		const float v = 1.0f / (1.0f - a);
+		if (s < a) {
+			return v * s * s / (2.0f * a);
+		} else if (s > 1.0f - a) {
+			return 1.0f - v * (1.0f - s) * (1.0f - s) / (2.0f * a);
+		}
+		return v * (s - a / 2.0f);
+	}
+	case MOTION_PROFILE_CUBIC:
+		return s * s * (3.0f - 2.0f * s);
+	default:
+		return s;
+	}
+}
+
+/*
+
+Evaluate a waveform.
+
+@param shape The shape, MOTION_WAVE_*
+@param x Phase, from 0 to 1
+@return The waveform value, from -1 to 1
+
+*/
+float motion_lld_wave(uint8_t shape, float x) {
+	switch (shape) {
+	case MOTION_WAVE_TRIANGLE:
+		if (x < 0.25f) {
+			return 4.0f * x;
+		} else if (x < 0.75f) {
+			return 2.0f - 4.0f * x;
+		}
+		return 4.0f * x - 4.0f;
+	case MOTION_WAVE_BREATHE:
+		// half cosine rise, then a slower half cosine fall
+		if (x < MOTION_BREATHE_RISE) {
+			return -cosf((float)M_PI * x / MOTION_BREATHE_RISE);
+		}
+		return cosf((float)M_PI * (x - MOTION_BREATHE_RISE) /
+		            (1.0f - MOTION_BREATHE_RISE));
+	default:
+		return sinf(2.0f * (float)M_PI * x);
+	}
+}
+
+/*
+
+Get the index of a neighbouring keyframe. Keyframes wrap around while
+the setpoints loop and are clamped at the ends otherwise.
+
+@param mdp The motion driver
+@param k Offset from the current keyframe, from -1 to 2
+@return The keyframe index
+
+*/
+size_t motion_lld_keyframe(MotionDriver *mdp, int32_t k) {
+	const int32_t n = mdp->sp->n;
+	const bool infinite = mdp->loop == MSGTYPE_LOOP_INFINITE;
+	int32_t i = (int32_t)mdp->spindex + k;
+	if (i < 0) {
+		// wrap after the first loop
+		i = (infinite || mdp->loop != mdp->sp->loop) ? i + n : 0;
+	} else if (i >= n) {
+		// wrap before the last loop
+		i = (infinite || mdp->loop > 1) ? i - n : n - 1;
+	}
+	return i < 0 ? 0 : i >= n ? n - 1 : i;
+}
+
+/*
+
+Interpolate between keyframes.
+
+@param mdp The motion driver
+@param interp The interpolation mode, MOTION_INTERP_*
+@return The setpoint
+
+*/
+uint16_t motion_lld_interp(MotionDriver *mdp, uint8_t interp) {
+	const msgtype_spvalue_t *spp = mdp->sp->setpoints;
+	const msgtype_spvalue_t *p1 = &spp[mdp->spindex];
+	const msgtype_spvalue_t *p2 = &spp[motion_lld_keyframe(mdp, 1)];
+	const float d = mdp->spduration;
+	const float s = (d - mdp->duration) / d;
+
+	if (interp == MOTION_INTERP_LINEAR) {
+		return p1->setpoint + (int32_t)(((int32_t)p2->setpoint - p1->setpoint) * s);
+	}
+
+	// tangents per ms from the neighbouring keyframes
+	const msgtype_spvalue_t *p0 = &spp[motion_lld_keyframe(mdp, -1)];
+	const msgtype_spvalue_t *p3 = &spp[motion_lld_keyframe(mdp, 2)];
+	float m1 = 0, m2 = 0;
+	if (p0->duration + p1->duration > 0) {
+		m1 = ((float)p2->setpoint - p0->setpoint) / (p0->duration + p1->duration);
+	}
+	if (p1->duration + p2->duration > 0) {
+		m2 = ((float)p3->setpoint - p1->setpoint) / (p1->duration + p2->duration);
+	}
+
+	// cubic Hermite basis
+	const float s2 = s * s, s3 = s2 * s;
+	float v = (2 * s3 - 3 * s2 + 1) * p1->setpoint +
+	          (s3 - 2 * s2 + s) * d * m1 +
+	          (-2 * s3 + 3 * s2) * p2->setpoint +
+	          (s3 - s2) * d * m2;
+	if (v < 0) {
+		return 0;
+	} else if (v > 0xffff) {
+		return 0xffff;
+	}
+	return v;
+}
+
+/*
+
+Update the current setpoint of setpoints evaluated on every tick.
+
+@param mdp The motion driver
+
+*/
+void motion_lld_eval(MotionDriver *mdp) {
+	if (mdp->sp == NULL) {
+		return;
+	}
+
+	switch (motionInfo(mdp->sp)->format) {
+
+	case MOTION_FORMAT_PROFILE: {
+		const motionprofile_t *mp = (void *)mdp->sp;
+		if (mdp->spindex != 0 || mdp->spduration == 0) {
+			break;
+		}
+		// reach the target on the last tick of the move
+		float s = (float)(mdp->spduration - mdp->duration + 1) / mdp->spduration;
+		int32_t start = mp->setpoints[0].setpoint;
+		int32_t d = (int32_t)mp->setpoints[1].setpoint - start;
+		mdp->setpoint = start + (int32_t)(d * motion_lld_profile(mp->profile, s));
+		break;
+	}
+
+	case MOTION_FORMAT_WAVE: {
+		const motionwave_t *wp = (void *)mdp->sp;
+		if (mdp->spduration == 0) {
+			break;
+		}
+		// one period per loop, starting at the given phase
+		uint32_t elapsed = mdp->spduration - mdp->duration;
+		uint16_t x = wp->phase + (elapsed << 16) / mdp->spduration;
+		float v = wp->amplitude * motion_lld_wave(wp->shape, x / 65536.0f);
+		int32_t setpoint = wp->setpoints[0].setpoint + (int32_t)v;
+		if (setpoint < 0) {
+			setpoint = 0;
+		} else if (setpoint > 0xffff) {
+			setpoint = 0xffff;
+		}
+		mdp->setpoint = setpoint;
+		break;
+	}
+
+	case MOTION_FORMAT_SETPOINT: {
+		uint8_t interp = motionInfo(mdp->sp)->interp;
+		if (interp != MOTION_INTERP_STEP && mdp->spduration > 0) {
+			mdp->setpoint = motion_lld_interp(mdp, interp);
+		}
+		break;
+	}
+
+	default:
+		break;
+
 	}
 }
 
@@ -67,26 +314,99 @@ void motion_lld_load_nextsp(MotionDriver *mdp) {
 	if (chMBFetch(mdp->config.mbox, &ptr, TIME_IMMEDIATE) == RDY_OK) {
 		// new setpoints available
 		mdp->nextsp = (msgtype_setpoint_t *)ptr;
+		motionStamp(mdp->nextsp, MOTION_STAGE_FETCH);
 		mdp->delay = mdp->nextsp->delay;
+		mdp->startmode = motionInfo(mdp->nextsp)->startmode;
+		mdp->start = motionInfo(mdp->nextsp)->start;
 	}
 }
 
 void motion_lld_activate_sp_after_delay(MotionDriver *mdp) {
 	// check delay for next setpoints
-	if (mdp->nextsp != NULL) {
+	if (mdp->nextsp == NULL) {
+		return;
+	}
+
+	switch (mdp->startmode) {
+	case MOTION_START_AT:
+		// wait for start tick
+		if ((int32_t)(motionClock(mdp) - mdp->start) < 0) {
+			return;
+		}
+		break;
+	case MOTION_START_APPEND:
+		// wait for current setpoints to finish looping
+		if (mdp->sp != NULL && mdp->loop > 0) {
+			return;
+		}
+		break;
+	default:
 		if (mdp->delay > 0) {
 			mdp->delay--;
-		} else {
-			motion_lld_free_sp(mdp);
-			mdp->sp = mdp->nextsp;
-			mdp->nextsp = NULL;
+			return;
+		}
+		break;
+	}
 
-			// reset state for new setpoint
-			mdp->loop = mdp->sp->loop;
-			mdp->spindex = 0;
-			motion_lld_load_sp_data(mdp);
+	motion_lld_free_sp(mdp);
+	mdp->sp = mdp->nextsp;
+	mdp->nextsp = NULL;
+
+	// start smooth moves where the motor is
+	if (motionInfo(mdp->sp)->format == MOTION_FORMAT_PROFILE) {
+		motionprofile_t *mp = (void *)mdp->sp;
+		if ((mp->flags & MOTION_PROFILE_CURRENT) && mdp->active) {
+			mp->setpoints[0].setpoint = mdp->rendered;
+		}
+	}
+
+	// reset state for new setpoint
+	mdp->loop = mdp->sp->loop;
+	mdp->spindex = 0;
+	motion_lld_load_sp_data(mdp);
+
+	// setpoints without loops stop the motor without an underrun hold
+	if (mdp->loop == 0) {
+		mdp->active = false;
+		mdp->underrunleft = 0;
+	}
+
+	motionStamp(mdp->sp, MOTION_STAGE_ACTIVATE);
+	mdp->actuate = mdp->loop != 0;
+}
+
+/*
+
+Add the latencies between the stages of the current setpoints to the
+latency histograms, once they are first rendered to the motor. Setpoint
+buffers not received from the bus are not counted.
+
+@param mdp The motion driver
+
+*/
+void motion_lld_latency(MotionDriver *mdp) {
+	motioninfo_t *info = motionInfo(mdp->sp);
+	size_t i;
+
+	mdp->actuate = false;
+	motionStamp(mdp->sp, MOTION_STAGE_ACTUATE);
+	if (info->stamps[MOTION_STAGE_RXSTART] == 0) {
+		return;
+	}
+
+	chSysLock();
+	for (i = 0; i < MOTION_STAGE_COUNT - 1; i++) {
+		uint32_t cycles = info->stamps[i + 1] - info->stamps[i];
+		cycles >>= MOTION_LATENCY_SHIFT;
+		size_t b = cycles == 0 ? 0 : 32 - __builtin_clz(cycles);
+		if (b >= MOTION_LATENCY_BUCKETS) {
+			b = MOTION_LATENCY_BUCKETS - 1;
+		}
+		if (mdp->latency[i][b] != 0xffff) {
+			mdp->latency[i][b]++;
 		}
 	}
+	chSysUnlock();
 }
 
 void motion_lld_step_motion(MotionDriver *mdp) {
@@ -117,6 +437,84 @@ void motion_lld_step_motion(MotionDriver *mdp) {
 	}
 }
 
+void motion_lld_load_target(MotionDriver *mdp) {
+	// take the latest target, if any
+	chSysLock();
+	uint32_t reg = mdp->targetreg;
+	mdp->targetreg = 0;
+	chSysUnlock();
+
+	if (reg != 0) {
+		mdp->target = reg & 0xffff;
+		mdp->targetleft = reg >> 16;
+	}
+}
+
+/*
+
+Track the rendered setpoint and its velocity for the underrun policy.
+
+@param mdp The motion driver
+@param setpoint The rendered setpoint
+
+*/
+void motion_lld_track(MotionDriver *mdp, uint16_t setpoint) {
+	int32_t x = (int32_t)setpoint << 8;
+	// smooth out the steps between setpoints
+	mdp->velocity += (x - mdp->estimate - mdp->velocity) / MOTION_VELOCITY_FILTER;
+	mdp->estimate = x;
+}
+
+/*
+
+Apply the underrun policy when there are no setpoints to render.
+
+@param mdp The motion driver
+@return true if the motor should keep rendering the estimated setpoint
+
+*/
+bool motion_lld_underrun(MotionDriver *mdp) {
+	// start underrun right after rendering setpoints
+	if (mdp->active && !mdp->underrun) {
+		mdp->underrun = true;
+		mdp->underrunleft = mdp->underruntime;
+	}
+
+	if (!mdp->underrun || mdp->underrunleft == 0) {
+		return false;
+	}
+	mdp->underrunleft--;
+
+	switch (mdp->underrunpolicy) {
+	case MOTION_UNDERRUN_HOLD:
+		return true;
+	case MOTION_UNDERRUN_EXTRAPOLATE:
+		// coast at the last velocity, decaying to a stop
+		mdp->estimate += mdp->velocity;
+		mdp->velocity -= mdp->velocity / MOTION_UNDERRUN_DECAY;
+		if (mdp->estimate < 0) {
+			mdp->estimate = 0;
+		} else if (mdp->estimate > (0xffff << 8)) {
+			mdp->estimate = 0xffff << 8;
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+
+Get the estimated setpoint during an underrun.
+
+@param mdp The motion driver
+@return The setpoint
+
+*/
+uint16_t motion_lld_estimate(MotionDriver *mdp) {
+	return mdp->estimate >> 8;
+}
+
 bool motion_lld_has_update(MotionDriver *mdp) {
 	// disable motor if there are no setpoints
 	if (mdp->sp == NULL) {
@@ -137,6 +535,24 @@ bool motion_lld_has_update(MotionDriver *mdp) {
 	return true;
 }
 
+void motion_lld_abort(MotionDriver *mdp) {
+	chSysLock();
+	bool abort = mdp->abort;
+	mdp->abort = false;
+	chSysUnlock();
+
+	if (abort) {
+		motion_lld_free_sp(mdp);
+		if (mdp->nextsp != NULL) {
+			chPoolFree(mdp->config.pool, mdp->nextsp);
+			mdp->nextsp = NULL;
+		}
+		mdp->targetleft = 0;
+		mdp->underrun = false;
+		mdp->active = false;
+	}
+}
+
 msg_t driver_thread(void *p) {
 	MotionDriver *mdp = p;
 	mdp->active = false;
@@ -146,11 +562,22 @@ msg_t driver_thread(void *p) {
 			continue;
 		}
 
+		motion_lld_abort(mdp);
 		motion_lld_load_nextsp(mdp);
 		motion_lld_activate_sp_after_delay(mdp);
 		motion_lld_free_sp_if_empty(mdp);
+		motion_lld_eval(mdp);
+		motion_lld_load_target(mdp);
+
+		// a live target pauses the queued setpoints
+		bool target = mdp->targetleft > 0;
+		uint16_t setpoint = target ? mdp->target : mdp->setpoint;
 
-		if (!motion_lld_has_update(mdp)) {
+		if (target || motion_lld_has_update(mdp)) {
+			mdp->underrun = false;
+		} else if (motion_lld_underrun(mdp)) {
+			setpoint = motion_lld_estimate(mdp);
+		} else {
 			motorSet(0);
 			mdp->active = false;
 			continue;
@@ -159,13 +586,26 @@ msg_t driver_thread(void *p) {
 		if (!mdp->active) {
 			rdReset(mdp->config.render);
 			mdp->active = true;
+			mdp->estimate = (int32_t)setpoint << 8;
+			mdp->velocity = 0;
 		}
 
 		rdWillRender(mdp->config.render);
 
-		int8_t pwm = rdRender(mdp->config.render, mdp->setpoint);
+		int8_t pwm = rdRender(mdp->config.render, setpoint);
 		motorSet(pwm);
-		motion_lld_step_motion(mdp);
+		mdp->rendered = setpoint;
+		if (target) {
+			mdp->targetleft--;
+		} else if (!mdp->underrun) {
+			if (mdp->actuate) {
+				motion_lld_latency(mdp);
+			}
+			motion_lld_step_motion(mdp);
+		}
+		if (!mdp->underrun) {
+			motion_lld_track(mdp, setpoint);
+		}
 
 		rdHasRendered(mdp->config.render);
 	}
@@ -186,6 +626,22 @@ void motionObjectInit(MotionDriver *mdp) {
 	mdp->nextsp = NULL;
 	mdp->spindex = 0;
 	mdp->loop = 0;
+	mdp->rendered = 0;
+	mdp->startmode = MOTION_START_DELAY;
+	mdp->actuate = false;
+	memset(mdp->latency, 0, sizeof(mdp->latency));
+	mdp->abort = false;
+	mdp->targetreg = 0;
+	mdp->target = 0;
+	mdp->targetleft = 0;
+	mdp->underrunpolicy = MOTION_UNDERRUN_STOP;
+	mdp->underruntime = 0;
+	mdp->underrunleft = 0;
+	mdp->underrun = false;
+	mdp->estimate = 0;
+	mdp->velocity = 0;
+	mdp->clock = 0;
+	mdp->slew = 0;
 }
 
 void motionStart(MotionDriver *mdp, MotionConfig *mdcfg) {
@@ -239,3 +695,94 @@ msg_t motionSetpoint(MotionDriver *mdp, msgtype_setpoint_t *sp) {
 	}
 	return chMBPost(mdp->config.mbox, (msg_t)sp, TIME_IMMEDIATE);
 }
+
+void motionAbort(MotionDriver *mdp) {
+	chSysLock();
+	motionAbortI(mdp);
+	chSysUnlock();
+}
+
+void motionAbortI(MotionDriver *mdp) {
+	msg_t ptr;
+	motorSetI(0);
+	// drop queued setpoints
+	while (chMBFetchI(mdp->config.mbox, &ptr) == RDY_OK) {
+		chPoolFreeI(mdp->config.pool, (void *)ptr);
+	}
+	mdp->targetreg = 0;
+	mdp->abort = true;
+}
+
+void motionSetTarget(MotionDriver *mdp, uint16_t setpoint, uint16_t timeout) {
+	// a nonzero timeout marks the register as written
+	if (timeout == 0) {
+		timeout = 1;
+	}
+	mdp->targetreg = ((uint32_t)timeout << 16) | setpoint;
+}
+
+void motionSetUnderrun(MotionDriver *mdp, uint8_t policy, uint16_t time) {
+	chSysLock();
+	mdp->underrunpolicy = policy;
+	mdp->underruntime = time;
+	chSysUnlock();
+}
+
+void motionGetLatency(MotionDriver *mdp, uint16_t *counts, bool reset) {
+	chSysLock();
+	memcpy(counts, mdp->latency, sizeof(mdp->latency));
+	if (reset) {
+		memset(mdp->latency, 0, sizeof(mdp->latency));
+	}
+	chSysUnlock();
+}
+
+void motionInfoInit(void *sp, size_t size) {
+	motioninfo_t *info = motionInfo(sp);
+	info->start = 0;
+	info->size = size;
+	info->format = MOTION_FORMAT_SETPOINT;
+	info->startmode = MOTION_START_DELAY;
+	info->interp = MOTION_INTERP_STEP;
+	memset(info->stamps, 0, sizeof(info->stamps));
+}
+
+bool motionCheckDelta(const msgtype_setpointdelta_t *sp, size_t size) {
+	size_t off = 0;
+	size_t i;
+
+	if (size < sizeof(*sp)) {
+		return false;
+	}
+	size -= sizeof(*sp);
+
+	// each setpoint is two varints
+	for (i = 0; i < 2 * (size_t)sp->n; i++) {
+		uint32_t v = 0;
+		size_t len = 0;
+		do {
+			if (off >= size || len == MOTION_VARINT_MAX) {
+				return false;
+			}
+			v |= (uint32_t)(sp->data[off] & 0x7f) << (7 * len++);
+		} while (sp->data[off++] & 0x80);
+		// durations and zigzag coded deltas are 16 bit values
+		if (v > 0xffff) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void motionSync(MotionDriver *mdp, uint32_t time, uint32_t rxclock) {
+	int32_t err = time - rxclock;
+	chSysLock();
+	if (err > MOTION_SYNC_STEP || err < -MOTION_SYNC_STEP) {
+		mdp->clock += err;
+		mdp->slew = 0;
+	} else {
+		mdp->slew = err;
+	}
+	chSysUnlock();
+}
@@ -18,6 +18,156 @@ Vancouver, B.C. V6T 1Z4 Canada
 #include "comm.h"
 #include "render.h"
 
+/* Setpoint data size of each setpoint buffer. */
+#define MOTION_SPDATA_SIZE              1024
+
+/* Setpoint data formats. */
+#define MOTION_FORMAT_SETPOINT          0 // msgtype_setpoint_t
+#define MOTION_FORMAT_DELTA             1 // msgtype_setpointdelta_t
+#define MOTION_FORMAT_PROFILE           2 // motionprofile_t
+#define MOTION_FORMAT_WAVE              3 // motionwave_t
+
+/* Setpoint interpolation modes, see MSGTYPE_INTERP_*. */
+#define MOTION_INTERP_STEP              MSGTYPE_INTERP_STEP
+#define MOTION_INTERP_LINEAR            MSGTYPE_INTERP_LINEAR
+#define MOTION_INTERP_CUBIC             MSGTYPE_INTERP_CUBIC
+
+/* Setpoint buffer start modes. */
+#define MOTION_START_DELAY              0 // after delay from fetch
+#define MOTION_START_AT                 1 // at clock tick `start`
+#define MOTION_START_APPEND             2 // when current setpoints finish
+
+/* Setpoint buffer stages, see msgtype_latencydata_t. */
+#define MOTION_STAGE_RXSTART            0 // first byte of frame read
+#define MOTION_STAGE_RXEND              1 // frame validated
+#define MOTION_STAGE_POST               2 // posted to the mailbox
+#define MOTION_STAGE_FETCH              3 // fetched by the driver thread
+#define MOTION_STAGE_ACTIVATE           4 // setpoints activated
+#define MOTION_STAGE_ACTUATE            5 // first rendered to the motor
+#define MOTION_STAGE_COUNT              6
+
+/* Number of log2 latency histogram buckets. */
+#define MOTION_LATENCY_BUCKETS          MSGTYPE_LATENCY_BUCKETS
+
+/* Latencies below 2^MOTION_LATENCY_SHIFT cycles go to the first bucket. */
+#define MOTION_LATENCY_SHIFT            8
+
+/* Maximum length of a varint in delta coded setpoints, in bytes. */
+#define MOTION_VARINT_MAX               3
+
+/* Smooth move profiles, see MSGTYPE_PROFILE_*. */
+#define MOTION_PROFILE_LINEAR           MSGTYPE_PROFILE_LINEAR
+#define MOTION_PROFILE_MINJERK          MSGTYPE_PROFILE_MINJERK
+#define MOTION_PROFILE_TRAPEZOID        MSGTYPE_PROFILE_TRAPEZOID
+#define MOTION_PROFILE_CUBIC            MSGTYPE_PROFILE_CUBIC
+
+/* Smooth move flags. */
+#define MOTION_PROFILE_CURRENT          0x01 // start at the rendered setpoint
+
+/* Fraction of a trapezoidal move spent on each ramp, as 1/n. */
+#define MOTION_TRAPEZOID_RAMP           4
+
+/*
+
+Smooth move, laid out as two setpoints so that the setpoint header and
+looping apply as for plain setpoints: the move from the first setpoint
+to the second, and the hold at the second. The first setpoint is
+replaced by the last rendered setpoint on activation with
+MOTION_PROFILE_CURRENT while the motor is active. During the move, the
+setpoint is evaluated from the profile on every tick.
+
+*/
+typedef struct {
+  uint16_t delay;                       // delay in ms
+  uint16_t loop;                        // loop
+  uint16_t n;                           // always 2
+  msgtype_spvalue_t setpoints[2];       // move time and start, hold and target
+  uint8_t profile;                      // MOTION_PROFILE_*
+  uint8_t flags;                        // MOTION_PROFILE_CURRENT
+} motionprofile_t;
+
+/* Waveform shapes, see MSGTYPE_WAVE_*. */
+#define MOTION_WAVE_SINE                MSGTYPE_WAVE_SINE
+#define MOTION_WAVE_TRIANGLE            MSGTYPE_WAVE_TRIANGLE
+#define MOTION_WAVE_BREATHE             MSGTYPE_WAVE_BREATHE
+
+/* Fraction of a breathing period spent rising. */
+#define MOTION_BREATHE_RISE             0.4f
+
+/*
+
+Waveform, laid out as a single setpoint holding the period and center
+that loops once per period. The setpoint is evaluated from the shape on
+every tick.
+
+*/
+typedef struct {
+  uint16_t delay;                       // delay in ms
+  uint16_t loop;                        // # of periods
+  uint16_t n;                           // always 1
+  msgtype_spvalue_t setpoints[1];       // period and center
+  uint8_t shape;                        // MOTION_WAVE_*
+  uint8_t reserved;                     // reserved
+  uint16_t amplitude;                   // peak deviation from center
+  uint16_t phase;                       // start phase, 1/65536 period
+} motionwave_t;
+
+/*
+
+Setpoint buffer information, stored after the setpoint data in each
+setpoint buffer so that the data starts at the beginning of the buffer.
+
+*/
+typedef struct {
+  uint32_t start;                       // clock tick to start at
+  uint16_t size;                        // setpoint data size
+  uint8_t format;                       // setpoint data format
+  uint8_t startmode;                    // when to start
+  uint8_t interp;                       // setpoint interpolation mode
+  uint32_t stamps[MOTION_STAGE_COUNT];  // cycle counter at each stage
+} motioninfo_t;
+
+/* Size of each setpoint buffer, including information. */
+#define MOTION_SPBUF_SIZE               (MOTION_SPDATA_SIZE + sizeof(motioninfo_t))
+
+/*
+
+Get the information of a setpoint buffer.
+
+@param sp The setpoint buffer
+
+*/
+#define motionInfo(sp) \
+  ((motioninfo_t *)((uint8_t *)(sp) + MOTION_SPDATA_SIZE))
+
+/* Underrun policies, when the setpoints run out. */
+#define MOTION_UNDERRUN_STOP            0 // disable motor output
+#define MOTION_UNDERRUN_HOLD            1 // hold the last setpoint
+#define MOTION_UNDERRUN_EXTRAPOLATE     2 // coast at the last velocity
+
+/* Ticks to smooth the setpoint velocity over. */
+#define MOTION_VELOCITY_FILTER          16
+
+/* Ticks for the extrapolated velocity to decay by a factor of e. */
+#define MOTION_UNDERRUN_DECAY           32
+
+/* Get the CPU cycle counter for timestamps. */
+#define motionCycles() (DWT->CYCCNT)
+
+/*
+
+Timestamp a setpoint buffer stage.
+
+@param sp The setpoint buffer
+@param stage The stage, MOTION_STAGE_*
+
+*/
+#define motionStamp(sp, stage) \
+  (motionInfo(sp)->stamps[(stage)] = motionCycles())
+
+/* Clock errors larger than this are stepped rather than slewed, in ms. */
+#define MOTION_SYNC_STEP                50
+
 /* Motion driver states. */
 typedef enum {
   MOTION_UNINIT = 0,
@@ -57,12 +207,41 @@ typedef struct {
   msgtype_setpoint_t *nextsp;           // next setpoints
 
   uint16_t delay;                       // delay until next setpoints
+  uint32_t start;                       // clock tick to start next setpoints
+  uint8_t startmode;                    // when to start next setpoints
   uint16_t loop;                        // loops for current setpoints
   uint16_t duration;                    // duration for current setpoint
+  uint16_t spduration;                  // full duration of current setpoint
   uint16_t setpoint;                    // current setpoint
+  uint16_t rendered;                    // last rendered setpoint
   size_t spindex;                       // setpoint offset
+  size_t spoffset;                      // coded setpoint byte offset
   bool active;                          // is the motion active?
 
+  /* Live target. */
+  volatile uint32_t targetreg;          // target written by motionSetTarget()
+  uint16_t target;                      // current live target
+  uint16_t targetleft;                  // ms until the target expires
+
+  /* Underrun policy. */
+  uint8_t underrunpolicy;               // what to do when setpoints run out
+  uint16_t underruntime;                // underrun hold time in ms
+  uint16_t underrunleft;                // ms until the hold expires
+  bool underrun;                        // are the setpoints run out?
+  int32_t estimate;                     // setpoint estimate, 24.8 fixed
+  int32_t velocity;                     // setpoint velocity per ms, 24.8 fixed
+
+  /* Latency histograms. */
+  bool actuate;                         // first render of setpoints pending
+  uint16_t latency[MOTION_STAGE_COUNT - 1][MOTION_LATENCY_BUCKETS];
+
+  /* Abort. */
+  volatile bool abort;                  // drop the current setpoints
+
+  /* Motion clock. */
+  volatile uint32_t clock;              // clock in ms, shared by all boards
+  int32_t slew;                         // clock error left to slew out
+
   /* Driver handles. */
   GPTDriver *gptp;                      // GPT driver
 
@@ -115,4 +294,112 @@ Queue next setpoint buffer.
 */
 msg_t motionSetpoint(MotionDriver *mdp, msgtype_setpoint_t *setpoint);
 
+/*
+
+Stop all motion right away: disable the motor output, drop all queued
+setpoints and the live target. The current setpoints are dropped by the
+driver thread on its next tick.
+
+@param mdp The motion driver
+
+*/
+void motionAbort(MotionDriver *mdp);
+
+/*
+
+Stop all motion right away, from an ISR or with the system locked.
+
+@param mdp The motion driver
+
+*/
+void motionAbortI(MotionDriver *mdp);
+
+/*
+
+Set the live target, overriding the queued setpoints from the next tick
+until `timeout` ms pass without a new target. The target is written to
+a single word read by the driver thread on every tick, so later targets
+replace earlier ones that have not been rendered yet.
+
+@param mdp The motion driver
+@param setpoint The target setpoint
+@param timeout Time to hold the target, in ms, at least 1
+
+*/
+void motionSetTarget(MotionDriver *mdp, uint16_t setpoint, uint16_t timeout);
+
+/*
+
+Set the underrun policy. When the setpoints run out, the motion driver
+holds the last setpoint or extrapolates the last setpoint velocity with
+exponential decay for `time` ms before it disables the motor output,
+so that late setpoints do not make the actuator go limp. Setpoints with
+a zero loop count and motionAbort() always disable the motor output
+right away.
+
+@param mdp The motion driver
+@param policy The underrun policy, MOTION_UNDERRUN_*
+@param time Time to hold or extrapolate, in ms
+
+*/
+void motionSetUnderrun(MotionDriver *mdp, uint8_t policy, uint16_t time);
+
+/*
+
+Copy the latency histograms, see msgtype_latencydata_t.
+
+@param mdp The motion driver
+@param counts Buffer for MOTION_STAGE_COUNT - 1 histograms
+@param reset Reset the histograms after copying them
+
+*/
+void motionGetLatency(MotionDriver *mdp, uint16_t *counts, bool reset);
+
+/*
+
+Initialize the information of a setpoint buffer for plain setpoints
+starting after their delay (MOTION_START_DELAY), without interpolation.
+Must be called on every setpoint buffer allocated from the pool.
+
+@param sp The setpoint buffer
+@param size The setpoint data size
+
+*/
+void motionInfoInit(void *sp, size_t size);
+
+/*
+
+Check that delta coded setpoints are well formed.
+
+@param sp The delta coded setpoints
+@param size The setpoint data size
+@return true if all `n` setpoints are within `size` and all values fit
+        in 16 bits
+
+*/
+bool motionCheckDelta(const msgtype_setpointdelta_t *sp, size_t size);
+
+/*
+
+Get the motion clock, in ms. The clock advances on every motion timer
+tick and is disciplined by `motionSync()`.
+
+@param mdp The motion driver
+
+*/
+#define motionClock(mdp) ((mdp)->clock)
+
+/*
+
+Synchronize the motion clock with the master clock. Small errors are
+slewed out at 1 ms per tick so that the clock never jumps; errors larger
+than MOTION_SYNC_STEP are stepped.
+
+@param mdp The motion driver
+@param time The master clock, in ms
+@param rxclock The motion clock when the master clock was received
+
+*/
+void motionSync(MotionDriver *mdp, uint32_t time, uint32_t rxclock);
+
 #endif // _MOTION_H_
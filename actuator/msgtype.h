@@ -23,23 +23,115 @@ Vancouver, B.C. V6T 1Z4 Canada
 #define ADDR_SPINE                      's' // spine actuator
 #define ADDR_HEAD_YAW                   'x' // head yaw actuator
 #define ADDR_HEAD_PITCH                 'y'	// head pitch actuator
+#define ADDR_BROADCAST                  '*' // all actuators
 
-/* Message types. */
+/* Message types, none of which reuse a board address. */
 #define MSGTYPE_INVALID                 0 // invalid message
 #define MSGTYPE_PING                    '?' // ping an actuator
 #define MSGTYPE_PONG                    '.' // respond to ping
 #define MSGTYPE_SETPID                  'c' // send PID coefficients
 #define MSGTYPE_SETPOINT                'g' // send setpoints
+#define MSGTYPE_MULTISETPOINT           'm' // broadcast setpoint slices
+#define MSGTYPE_SETPOINTAT              'a' // send setpoints at clock tick
+#define MSGTYPE_SETPOINTDELTA           'd' // send delta coded setpoints
+#define MSGTYPE_SYNC                    'k' // synchronize motion clock
+#define MSGTYPE_POLL                    'q' // poll status of all boards
+#define MSGTYPE_STATUS                  'u' // status response to poll
+#define MSGTYPE_BITRATE                 'b' // change bus bit rate
+#define MSGTYPE_STREAM                  'f' // stream setpoints
+#define MSGTYPE_CREDIT                  'n' // stream credit response
+#define MSGTYPE_TARGET                  'l' // set live target
+#define MSGTYPE_UNDERRUN                'j' // set underrun policy
+#define MSGTYPE_BUNDLE                  'w' // send several commands
+#define MSGTYPE_TELEMETRY               'i' // get telemetry
+#define MSGTYPE_TELEMETRYDATA           'I' // telemetry response
+#define MSGTYPE_LATENCY                 'L' // get latency histograms
+#define MSGTYPE_LATENCYDATA             'M' // latency histogram response
+#define MSGTYPE_HEALTH                  'H' // get bus health counters
+#define MSGTYPE_HEALTHDATA              'G' // bus health response
+#define MSGTYPE_FRAMING                 'V' // set frame version
+#define MSGTYPE_ACK                     'o' // sequenced message accepted
+#define MSGTYPE_NACK                    'e' // sequenced message rejected
 #define MSGTYPE_SLEEP                   'z' // deactivate motor output
-#define MSGTYPE_SMOOTH			'h' // send interval setpoints
+#define MSGTYPE_SMOOTH                  'h' // smooth move to a setpoint
 #define MSGTYPE_TEST                    't' // run internal tests
 #define MSGTYPE_VALUE                   'v' // get position value
+#define MSGTYPE_WAVE                    'W' // play a waveform
+#define MSGTYPE_KEYFRAME                'K' // send interpolated setpoints
+
+/* Message type flags. */
+#define MSGTYPE_SEQ                     0x80 // message is sequenced
+
+/* Message size flags. */
+#define MSGTYPE_SIZE_CRC32              0x8000 // crc-32 footer, version 2
+
+/* Frame versions. */
+#define MSGTYPE_FRAMING_V1              1 // crc-16 footer
+#define MSGTYPE_FRAMING_V2              2 // crc-32 footer
+
+/*
+
+Frames to ADDR_BROADCAST are accepted only for message types to which
+boards do not respond, so that boards never drive the bus at once:
+MSGTYPE_MULTISETPOINT, MSGTYPE_SETPOINTAT, MSGTYPE_SYNC, MSGTYPE_POLL,
+MSGTYPE_BITRATE and MSGTYPE_SLEEP. Responses to MSGTYPE_POLL are sent in
+per-board slots. Broadcasts of other message types are ignored.
+
+*/
+
+/*
+
+A line break on the bus, i.e. the line held low for at least 11 bit
+times, stops all boards like MSGTYPE_SLEEP as soon as it is detected,
+even in the middle of a frame. The frame being received is dropped.
+
+*/
 
 /* Setpoint loop special values. */
 #define MSGTYPE_LOOP_INFINITE           0xffff
 
-/* Smooth motions values */
-#define SMOOTH_MININTERVAL_MS		50
+/* Stream flags. */
+#define MSGTYPE_STREAM_FIRST            0x01 // first chunk of a stream
+
+/* Default time a live target is held, in ms. */
+#define MSGTYPE_TARGET_TIMEOUT_MS       100
+
+/* Telemetry flags. */
+#define MSGTYPE_TELEMETRY_ACTIVE        0x01 // motor output enabled
+#define MSGTYPE_TELEMETRY_TARGET        0x02 // live target rendered
+#define MSGTYPE_TELEMETRY_UNDERRUN      0x04 // setpoints have run out
+
+/* Latency histogram stages and buckets per stage. */
+#define MSGTYPE_LATENCY_STAGES          5
+#define MSGTYPE_LATENCY_BUCKETS         16
+
+/* Latency flags. */
+#define MSGTYPE_LATENCY_RESET           0x01 // reset after reading
+
+/* Health flags. */
+#define MSGTYPE_HEALTH_RESET            0x01 // reset after reading
+
+/* Time to receive a valid frame after a bit rate change, in ms. */
+#define MSGTYPE_BITRATE_TIMEOUT_MS      1000
+
+/* Smooth move profiles. */
+#define MSGTYPE_PROFILE_LINEAR          0 // constant velocity
+#define MSGTYPE_PROFILE_MINJERK         1 // minimum jerk
+#define MSGTYPE_PROFILE_TRAPEZOID       2 // trapezoidal velocity
+#define MSGTYPE_PROFILE_CUBIC           3 // cubic, zero end velocity
+
+/* Smooth move flags. */
+#define MSGTYPE_SMOOTH_START            0x01 // start at `start`
+
+/* Waveform shapes. */
+#define MSGTYPE_WAVE_SINE               0 // sine, rising through center
+#define MSGTYPE_WAVE_TRIANGLE           1 // triangle, rising through center
+#define MSGTYPE_WAVE_BREATHE            2 // breathing, from the bottom
+
+/* Keyframe interpolation modes. */
+#define MSGTYPE_INTERP_STEP             0 // hold each setpoint
+#define MSGTYPE_INTERP_LINEAR           1 // linear
+#define MSGTYPE_INTERP_CUBIC            2 // cubic Hermite, Catmull-Rom tangents
 
 
 #pragma pack(push, 1)  /* set alignment to 1 byte boundary */
@@ -56,6 +148,18 @@ typedef struct {
 	uint16_t crc16;                       // offset 0x00, crc-16 checksum
 } msgtype_footer_t;
 
+/*
+
+Version 2 message footer. A version 2 frame has the MSGTYPE_SIZE_CRC32
+flag set in the size of its header, so that boards using either version
+can skip it by its length, and ends with a CRC-32 of the header and data
+as computed by the STM32 CRC unit, see crc32.h.
+
+*/
+typedef struct {
+	uint32_t crc32;                       // offset 0x00, crc-32 checksum
+} msgtype_footer32_t;
+
 /* Short message. */
 typedef struct {
 	uint8_t addr;                         // offset 0x00, board address
@@ -85,12 +189,363 @@ typedef struct {
 	msgtype_spvalue_t setpoints[0];       // offset 0x08, setpoints
 } msgtype_setpoint_t;
 
-/* Message to smoothly move towards a setpoint */
+/*
+
+Message to smoothly move towards a setpoint. The move takes `time` ms
+along the given profile and the target is then held for its duration.
+The move starts at the last rendered setpoint, or at the current
+position if the motor is idle, unless MSGTYPE_SMOOTH_START is set. The
+motion driver evaluates the profile on every tick. The fields after
+`target` are optional and default to zero, so a 6 byte message makes a
+linear move.
+
+*/
 typedef struct {
-	uint16_t time;			      // offset 0x00, time to get to setpoint in ms
-	msgtype_spvalue_t setpoints[0];       // offset 0x02, setpoint
+	uint16_t time;                        // offset 0x00, time to get to setpoint in ms
+	msgtype_spvalue_t target;             // offset 0x02, setpoint and hold time
+	uint8_t profile;                      // offset 0x06, MSGTYPE_PROFILE_*
+	uint8_t flags;                        // offset 0x07, MSGTYPE_SMOOTH_*
+	uint16_t start;                       // offset 0x08, start setpoint
 } msgtype_smooth_t;
 
+/*
+
+Message to play a periodic waveform around `center`, synthesized by the
+motion driver on every tick. The breathing shape rises over the first
+2/5 of the period and falls over the rest, each with a half cosine. The
+waveform replaces the current setpoints like a setpoint message and
+plays for `count` periods, or forever with MSGTYPE_LOOP_INFINITE. A
+`count` of 0 is rejected. Setpoints are clamped to the setpoint range.
+
+*/
+typedef struct {
+	uint8_t shape;                        // offset 0x00, MSGTYPE_WAVE_*
+	uint8_t reserved;                     // offset 0x01, reserved
+	uint16_t center;                      // offset 0x02, center setpoint
+	uint16_t amplitude;                   // offset 0x04, peak deviation
+	uint16_t period;                      // offset 0x06, period in ms
+	uint16_t phase;                       // offset 0x08, start phase, 1/65536 period
+	uint16_t count;                       // offset 0x0a, # of periods
+} msgtype_wave_t;
+
+/*
+
+Message to send delta coded setpoints. The header is the same as for
+msgtype_setpoint_t. The data holds `n` setpoints, each a varint duration
+in ms followed by a varint zigzag coded setpoint delta. Varints are
+little endian base-128, 7 bits per byte with the high bit set on all but
+the last byte. Deltas are taken modulo 2^16 from the previous setpoint,
+starting from 0, so each setpoint takes 2 to 6 bytes. Varints longer
+than 3 bytes or with values above 0xffff are rejected.
+
+*/
+typedef struct {
+	uint16_t delay;                       // offset 0x00, delay in ms
+	uint16_t loop;                        // offset 0x02, loop
+	uint16_t n;                           // offset 0x04, # of setpoints
+	uint8_t data[0];                      // offset 0x06, coded setpoints
+} msgtype_setpointdelta_t;
+
+/*
+
+Message to send setpoints starting at an absolute motion clock tick, so
+that all boards start on the same millisecond. The `delay` field of the
+setpoints is ignored.
+
+*/
+typedef struct {
+	uint32_t start;                       // offset 0x00, start tick in ms
+	msgtype_setpoint_t sp;                // offset 0x04, setpoints
+} msgtype_setpointat_t;
+
+/*
+
+Message to send setpoints as keyframes. Instead of holding each setpoint
+for its duration, the motion driver interpolates from it to the next one
+on every tick. The tangents of cubic interpolation are the slopes
+between the neighbouring keyframes, scaled for uneven durations. The
+last keyframe interpolates towards the first one while the setpoints
+loop, and is held on the last loop.
+
+*/
+typedef struct {
+	uint8_t interp;                       // offset 0x00, MSGTYPE_INTERP_*
+	uint8_t reserved;                     // offset 0x01, reserved
+	msgtype_setpoint_t sp;                // offset 0x02, setpoints
+} msgtype_keyframe_t;
+
+/*
+
+Message to synchronize the motion clock. Broadcast to ADDR_BROADCAST so
+that all boards receive the frame at the same moment.
+
+*/
+typedef struct {
+	uint32_t time;                        // offset 0x00, master clock in ms
+} msgtype_sync_t;
+
+/*
+
+Message to poll the status of all boards. Broadcast to ADDR_BROADCAST,
+each board responds with a MSGTYPE_STATUS frame in the slot given by its
+address, starting with the ribs right after the poll. The payload is
+optional. The default slot length is the time to send a MSGTYPE_STATUS
+frame at the current bit rate, rounded up to whole ms, plus 2 ms for the
+jitter between boards. Shorter slots are rejected.
+
+*/
+typedef struct {
+	uint16_t slot;                        // offset 0x00, slot length in ms
+} msgtype_poll_t;
+
+/*
+
+Status response, sent as a frame with the board address, a
+MSGTYPE_STATUS message type and a crc-16 checksum.
+
+*/
+typedef struct {
+	float position;                       // offset 0x00, position in rad
+	int8_t pwm;                           // offset 0x04, motor output
+} msgtype_status_t;
+
+/*
+
+Telemetry response to MSGTYPE_TELEMETRY, sent as a frame with the board
+address, a MSGTYPE_TELEMETRYDATA message type and a crc-16 checksum. All
+fields are taken between two motion ticks, at motion clock tick `clock`.
+The position and PID fields are zero on the purr motor.
+
+*/
+typedef struct {
+	uint32_t clock;                       // offset 0x00, motion clock in ms
+	float position;                       // offset 0x04, position in rad
+	float error;                          // offset 0x08, PID error
+	float integral;                       // offset 0x0c, PID integral
+	uint16_t setpoint;                    // offset 0x10, rendered setpoint
+	uint16_t spindex;                     // offset 0x12, setpoint index
+	uint16_t loop;                        // offset 0x14, loops left
+	int8_t pwm;                           // offset 0x16, motor output
+	uint8_t flags;                        // offset 0x17, telemetry flags
+} msgtype_telemetry_t;
+
+/*
+
+Message to get the latency histograms. The payload is optional.
+
+*/
+typedef struct {
+	uint8_t flags;                        // offset 0x00, latency flags
+} msgtype_latency_t;
+
+/*
+
+Latency histogram response, sent as a frame with the board address, a
+MSGTYPE_LATENCYDATA message type and a crc-16 checksum. Setpoint buffers
+are timestamped with the CPU cycle counter as they pass each stage:
+
+  0   first byte of the frame read from the receive ring
+  1   frame validated
+  2   posted to the setpoint mailbox
+  3   fetched by the motion driver
+  4   activated by the motion driver
+  5   first rendered to the motor
+
+Histogram `i` counts the latencies from stage `i` to stage `i + 1`.
+Bucket 0 counts latencies below 2^8 cycles, bucket `j` those from
+2^(j + 7) up to 2^(j + 8) cycles, and the last bucket all longer ones.
+Counts saturate.
+
+*/
+typedef struct {
+	uint16_t counts[MSGTYPE_LATENCY_STAGES][MSGTYPE_LATENCY_BUCKETS];
+} msgtype_latencydata_t;
+
+/*
+
+Message to get the bus health counters. The payload is optional.
+
+*/
+typedef struct {
+	uint8_t flags;                        // offset 0x00, health flags
+} msgtype_health_t;
+
+/*
+
+Bus health response, sent as a frame with the board address, a
+MSGTYPE_HEALTHDATA message type and a crc-16 checksum. The counters
+count up from power on or the last reset, wrapping around. The transmit
+turnaround is the time measured from taking the transmission complete
+interrupt at the end of a response to releasing the bus driver and
+re-enabling the receiver, in CPU cycles at 168 MHz.
+
+*/
+typedef struct {
+	uint32_t bytes;                       // offset 0x00, bytes received
+	uint32_t frames;                      // offset 0x04, valid frames
+	uint32_t foreign;                     // offset 0x08, frames for others
+	uint32_t timeouts;                    // offset 0x0c, frames cut short
+	uint32_t crcerrors;                   // offset 0x10, checksum mismatches
+	uint32_t oversize;                    // offset 0x14, invalid sizes
+	uint32_t poolempty;                   // offset 0x18, out of buffers
+	uint32_t mboxfull;                    // offset 0x1c, setpoint queue full
+	uint32_t framing;                     // offset 0x20, framing errors
+	uint32_t noise;                       // offset 0x24, noise errors
+	uint32_t parity;                      // offset 0x28, parity errors
+	uint32_t overrun;                     // offset 0x2c, receive overruns
+	uint32_t breaks;                      // offset 0x30, line breaks
+	uint32_t turnaround;                  // offset 0x34, last TC IRQ to TXEN low
+	uint32_t turnaroundmax;               // offset 0x38, longest turnaround
+} msgtype_healthdata_t;
+
+/*
+
+Message to change the bus bit rate. Broadcast to ADDR_BROADCAST so that
+all boards switch at the same moment. A board falls back to the default
+bit rate unless it receives a valid frame addressed to it or to all
+boards within MSGTYPE_BITRATE_TIMEOUT_MS of switching. Boards do not
+confirm the switch themselves: the master sends MSGTYPE_POLL at the new
+bit rate in time, which keeps the boards at the new bit rate, and takes
+the slotted status responses as confirmation from each board.
+
+*/
+typedef struct {
+	uint32_t speed;                       // offset 0x00, bit rate in baud
+	uint16_t delay;                       // offset 0x04, delay in ms
+} msgtype_bitrate_t;
+
+/*
+
+Message to stream setpoints. Each chunk starts when the setpoints before
+it finish looping, ignoring its delay, so that chunks play back to back.
+Chunks are accepted in sequence only: a chunk with an unexpected
+sequence number, or one that cannot be queued, is dropped. Every chunk
+is answered with a MSGTYPE_CREDIT response.
+
+*/
+typedef struct {
+	uint16_t seq;                         // offset 0x00, sequence number
+	uint8_t flags;                        // offset 0x02, stream flags
+	uint8_t reserved;                     // offset 0x03, reserved
+	msgtype_setpoint_t sp;                // offset 0x04, setpoints
+} msgtype_stream_t;
+
+/*
+
+Stream credit response, sent as a frame with the board address, a
+MSGTYPE_CREDIT message type and a crc-16 checksum. The master may send
+up to `credit` chunks starting at sequence number `seq` without waiting
+for further responses.
+
+*/
+typedef struct {
+	uint16_t seq;                         // offset 0x00, next expected chunk
+	uint8_t credit;                       // offset 0x02, chunks that fit
+} msgtype_credit_t;
+
+/*
+
+Message to set the live target for teleoperation. The target is applied
+as soon as the frame is received, bypassing the setpoint queue, and is
+rendered on every tick until it is replaced by the next target or until
+`timeout` ms pass without one, after which the queued setpoints resume.
+A zero timeout defaults to MSGTYPE_TARGET_TIMEOUT_MS. Targets are
+neither sequenced nor acknowledged.
+
+*/
+typedef struct {
+	uint16_t setpoint;                    // offset 0x00, setpoint
+	uint16_t timeout;                     // offset 0x02, timeout in ms
+} msgtype_target_t;
+
+/*
+
+Message to set what the board does when its setpoints run out: disable
+the motor output (0), hold the last setpoint (1) or extrapolate the last
+setpoint velocity with decay (2) for `time` ms, then disable the motor
+output.
+
+*/
+typedef struct {
+	uint8_t policy;                       // offset 0x00, underrun policy
+	uint8_t reserved;                     // offset 0x01, reserved
+	uint16_t time;                        // offset 0x02, hold time in ms
+} msgtype_underrun_t;
+
+/*
+
+Message to set the frame version used by a board. Boards start with
+version 1 and ignore version 2 frames until switched to version 2. The
+board answers with a MSGTYPE_FRAMING frame holding the new version, in
+the old version, and then uses the new version for all frames it sends
+and receives. Broadcasts must use a version that all boards accept.
+
+*/
+typedef struct {
+	uint8_t version;                      // offset 0x00, frame version
+} msgtype_framing_t;
+
+/*
+
+Sequence number prefix. A message with the MSGTYPE_SEQ flag set in its
+type starts with a sequence number, covered by the size and checksum of
+the message, followed by the usual data for the message type. The board
+answers each sequenced message addressed to it with a MSGTYPE_ACK
+response once serviced, or a MSGTYPE_NACK response if it cannot be
+serviced. A message that fails the checksum is dropped without a
+response, as its address and sequence number cannot be trusted; the
+master retransmits it when no response arrives in time, so that only
+the messages that were lost are sent again. A retransmission of a message that was already
+accepted is acknowledged again without being serviced twice. Sequence
+numbers are compared modulo 2^16 against a window of the last 32
+accepted; sequenced broadcasts are not acknowledged.
+
+*/
+typedef struct {
+	uint16_t seq;                         // offset 0x00, sequence number
+} msgtype_seq_t;
+
+/*
+
+Acknowledgement response, sent as a frame with the board address, a
+MSGTYPE_ACK or MSGTYPE_NACK message type and a crc-16 checksum.
+
+*/
+typedef struct {
+	uint16_t seq;                         // offset 0x00, sequence number
+} msgtype_ack_t;
+
+/*
+
+Per-board slice of a broadcast message. A MSGTYPE_MULTISETPOINT message
+to ADDR_BROADCAST is a sequence of slices, each holding a
+msgtype_setpoint_t for the board at `addr`.
+
+*/
+typedef struct {
+	uint8_t addr;                         // offset 0x00, board address
+	uint8_t reserved;                     // offset 0x01, reserved
+	uint16_t size;                        // offset 0x02, slice data size
+	uint8_t data[0];                      // offset 0x04, slice data
+} msgtype_slice_t;
+
+/*
+
+Sub-command of a bundle message. A MSGTYPE_BUNDLE message is a sequence
+of sub-commands, each holding the data of a message of type `type`, e.g.
+MSGTYPE_SETPID, MSGTYPE_SETPOINT, MSGTYPE_SMOOTH or MSGTYPE_VALUE. The
+sub-commands are serviced in order as if sent in separate frames, under
+the header and checksum of the bundle, stopping at the first one that
+fails. Bundles may not be nested.
+
+*/
+typedef struct {
+	uint8_t type;                         // offset 0x00, message type
+	uint8_t reserved;                     // offset 0x01, reserved
+	uint16_t size;                        // offset 0x02, sub-command size
+	uint8_t data[0];                      // offset 0x04, sub-command data
+} msgtype_subcmd_t;
+
 #pragma pack(pop)   /* restore original alignment from stack */
 
 #endif // _MSGTYPE_H_
@@ -9,6 +9,8 @@ Vancouver, B.C. V6T 1Z4 Canada
 
 */
 
+#include <string.h>
+
 #include <ch.h>
 #include <hal.h>
 
@@ -16,53 +18,193 @@ Vancouver, B.C. V6T 1Z4 Canada
 
 RS485Driver RSD3;
 
-void txend1_cb(UARTDriver *uartp) {
-	if (uartp == RSD3.uart) {
-		chSysLockFromIsr();
-		chBSemSignalI(&RSD3.ready);
-		chSysUnlockFromIsr();
+/*
+
+Release the RS-485 driver and switch back to receiving. Must be called
+with the system locked.
+
+*/
+static void rs485_lld_release_tx(RS485Driver *rsp) {
+	// disable RS-485 driver
+	palClearPad(GPIOB, GPIOB_RS485_TXEN);
+	// disable transmitter and enable receiver
+	rsp->uart->usart->CR1 = rsp->txcr1;
+	rsp->transmitting = false;
+}
+
+/*
+
+Record the transmit turnaround since `tc`, the cycle count at which the
+TC interrupt was taken. Must be called with the system locked, after the
+RS-485 driver is released.
+
+*/
+static void rs485_lld_turnaround(RS485Driver *rsp, uint32_t tc) {
+	rsp->stats.turnaround = DWT->CYCCNT - tc;
+	if (rsp->stats.turnaround > rsp->stats.turnaroundmax) {
+		rsp->stats.turnaroundmax = rsp->stats.turnaround;
 	}
 }
 
-void rxend_cb(UARTDriver *uartp) {
+/*
+
+Called from the transmission complete (TC) interrupt once the stop bit
+of the last byte has left the wire. The TC flag is also set after the
+idle frame sent when the UART driver starts, which is ignored.
+
+*/
+void txend2_cb(UARTDriver *uartp) {
+	uint32_t tc = DWT->CYCCNT;
 	if (uartp == RSD3.uart) {
 		chSysLockFromIsr();
-		chBSemSignalI(&RSD3.ready);
-		RSD3.e = 0;
+		if (RSD3.transmitting) {
+			rs485_lld_release_tx(&RSD3);
+			rs485_lld_turnaround(&RSD3, tc);
+			chBSemSignalI(&RSD3.ready);
+		}
 		chSysUnlockFromIsr();
 	}
 }
 
+/*
+
+The receive DMA runs in circular mode over the receive ring, so the UART
+driver stays in its idle state and invokes this callback on every half
+and full transfer interrupt. The character argument is meaningless here.
+
+*/
 void rxchar_cb(UARTDriver *uartp, uint16_t c) {
+	(void)c;
 	if (uartp == RSD3.uart) {
-		if (RSD3.buf == NULL) {
-			return;
-		}
-		if (RSD3.len >= RSD3.i) {
-			RSD3.buf = NULL;
-			chSysLockFromIsr();
-			chBSemSignalI(&RSD3.ready);
-			RSD3.e = 0;
-			chSysUnlockFromIsr();
+		chSysLockFromIsr();
+		RSD3.rxhead += RS485_RXRING_SIZE / 2;
+		// unread data has been overwritten
+		if (RSD3.rxhead - RSD3.rxtail > RS485_RXRING_SIZE) {
+			RSD3.e |= UART_OVERRUN_ERROR;
+			RSD3.stats.overrun++;
 		}
-		RSD3.buf[RSD3.i++] = c;
+		chBSemSignalI(&RSD3.rxready);
+		chSysUnlockFromIsr();
+	}
+}
+
+static void rs485_lld_count_errors(RS485Driver *rsp, uartflags_t e) {
+	if (e & UART_FRAMING_ERROR) {
+		rsp->stats.framing++;
+	}
+	if (e & UART_NOISE_ERROR) {
+		rsp->stats.noise++;
+	}
+	if (e & UART_PARITY_ERROR) {
+		rsp->stats.parity++;
+	}
+	if (e & UART_OVERRUN_ERROR) {
+		rsp->stats.overrun++;
+	}
+	if (e & UART_BREAK_DETECTED) {
+		rsp->stats.breaks++;
 	}
 }
 
 void rxerr_cb(UARTDriver *uartp, uartflags_t e) {
 	if (uartp == RSD3.uart) {
 		chSysLockFromIsr();
-		chBSemSignalI(&RSD3.ready);
-		RSD3.e = e;
+		RSD3.e |= e;
+		rs485_lld_count_errors(&RSD3, e);
+		// act on a line break without waiting for the reader
+		if ((e & UART_BREAK_DETECTED) && RSD3.breakcb != NULL) {
+			RSD3.breakcb();
+		}
+		chBSemSignalI(&RSD3.rxready);
+		chSysUnlockFromIsr();
+	}
+}
+
+/*
+
+Get the absolute count of bytes written into the receive ring by the DMA.
+Must be called with the system locked.
+
+*/
+static uint32_t rs485_lld_rxhead(RS485Driver *rsp) {
+	const uint32_t mask = RS485_RXRING_SIZE - 1;
+	size_t pos = RS485_RXRING_SIZE -
+	             dmaStreamGetTransactionSize(rsp->uart->dmarx);
+	uint32_t head = rsp->rxhead;
+	uint32_t off = head & mask;
+	// the DMA may have wrapped before its interrupt was serviced
+	if (pos < off) {
+		head += RS485_RXRING_SIZE;
+	}
+	return (head & ~mask) + pos;
+}
+
+/*
+
+Get the receive idle timer interval at the current bit rate, in timer
+ticks of 1 us, for RS485_IDLE_CHARS characters of up to 11 bits.
+
+*/
+static gptcnt_t rs485_lld_idle_interval(RS485Driver *rsp) {
+	uint32_t us = (uint64_t)RS485_IDLE_CHARS * 11 * 1000000 /
+	              rsp->config.speed;
+	if (us < RS485_IDLE_MIN_US) {
+		us = RS485_IDLE_MIN_US;
+	}
+	return us < 0xffff ? us : 0xffff;
+}
+
+/*
+
+Start the receive idle timer unless it is already running. Must be
+called with the system locked.
+
+*/
+static void rs485_lld_watch_idle(RS485Driver *rsp) {
+	if (rsp->gpt->state == GPT_READY) {
+		rsp->idlewatch = rs485_lld_rxhead(rsp);
+		gptStartOneShotI(rsp->gpt, rs485_lld_idle_interval(rsp));
+	}
+}
+
+/*
+
+Called from the receive idle timer. New bytes in the receive ring wake
+the reader, and an interval without new bytes marks the line idle. The
+timer keeps running while bytes arrive or the reader waits.
+
+*/
+void rxidle_cb(GPTDriver *gptp) {
+	if (gptp == RSD3.gpt) {
+		chSysLockFromIsr();
+		uint32_t head = rs485_lld_rxhead(&RSD3);
+		bool arrived = head != RSD3.idlewatch;
+		if (arrived) {
+			chBSemSignalI(&RSD3.rxready);
+		} else if (head != RSD3.idlehead) {
+			RSD3.idlehead = head;
+			chBSemSignalI(&RSD3.rxidle);
+		}
+		if (arrived || RSD3.rxwaiting) {
+			rs485_lld_watch_idle(&RSD3);
+		}
 		chSysUnlockFromIsr();
 	}
 }
 
+/* Receive idle timer configuration, counting in us. */
+const GPTConfig rxidlecfg = {
+	.frequency = 1000000,
+	.callback = rxidle_cb,
+	// hardware-specfic configuration
+	.dier = 0
+};
+
 const UARTConfig uartcfg = {
-	.txend1_cb = txend1_cb, // End of transmission buffer callback.
-	.txend2_cb = NULL,      // Physical end of transmission callback.
-	.rxend_cb = rxend_cb,   // Receive buffer filled callback.
-	.rxchar_cb = NULL,      // Character received while idle.
+	.txend1_cb = NULL,      // End of transmission buffer callback.
+	.txend2_cb = txend2_cb, // Physical end of transmission callback.
+	.rxend_cb = NULL,       // Receive buffer filled callback.
+	.rxchar_cb = rxchar_cb, // Receive ring half filled callback.
 	.rxerr_cb = rxerr_cb,   // Receive error callback.
 	// hardware-specific configuration
 	.speed = SERIAL_DEFAULT_BITRATE,
@@ -76,33 +218,36 @@ static size_t writet(void *ip, const uint8_t *bp, size_t n, systime_t time) {
 	// lock system and UART
 	chSysLock();
 	chMtxLockS(&rsp->lock);
-	// wait for idle
-	uint32_t cr1 = rsp->uart->usart->CR1;
-	rsp->uart->usart->CR1 |= USART_CR1_RWU;
-	while (rsp->uart->usart->CR1 & USART_CR1_RWU) {
-		chSchDoYieldS();
+	// wait until no bytes have arrived since the line last went idle,
+	// as responses may be queued while the master sends the next frame;
+	// frames muted by address-mark wakeup are not seen
+	while (rs485_lld_rxhead(rsp) != rsp->idlehead) {
+		rs485_lld_watch_idle(rsp);
+		rsp->err = chBSemWaitTimeoutS(&rsp->rxidle, time);
+		if (rsp->err != RDY_OK) {
+			chMtxUnlockS();
+			chSysUnlock();
+			return 0;
+		}
 	}
-	// enable transmitter
-	rsp->uart->usart->CR1 = (cr1 & ~USART_CR1_RE) | USART_CR1_TE;
+	// the receiver state is restored on completion
+	rsp->txcr1 = rsp->uart->usart->CR1;
+	// enable transmitter, which first sends an idle frame
+	rsp->uart->usart->CR1 = (rsp->txcr1 & ~USART_CR1_RE) | USART_CR1_TE;
 	// enable RS-485 driver
 	palSetPad(GPIOB, GPIOB_RS485_TXEN);
-	// start sending
+	// start sending, dropping a completion left from before
+	chBSemResetI(&rsp->ready, TRUE);
+	rsp->transmitting = true;
 	uartStartSendI(rsp->uart, n, bp);
-	// wait until finished
+	// wait for the TC interrupt to release the RS-485 driver
 	rsp->err = chBSemWaitTimeoutS(&rsp->ready, time);
 	if (rsp->err != RDY_OK) {
 		// stop sending due to error
-		n = uartStopSendI(rsp->uart);
-	} else {
-		// wait until add data cleared
-		while (!(rsp->uart->usart->SR & USART_SR_TC)) {
-			chSchDoYieldS();
-		}
+		n -= uartStopSendI(rsp->uart);
+		rsp->uart->usart->CR1 &= ~USART_CR1_TCIE;
+		rs485_lld_release_tx(rsp);
 	}
-	// disable RS-485 driver
-	palClearPad(GPIOB, GPIOB_RS485_TXEN);
-	// disable transmitter
-	rsp->uart->usart->CR1 = cr1;
 	// unlock UART and system
 	chMtxUnlockS();
 	chSysUnlock();
@@ -110,24 +255,46 @@ static size_t writet(void *ip, const uint8_t *bp, size_t n, systime_t time) {
 	return n;
 }
 
-static size_t readt(void *ip, uint8_t *bp, size_t n, systime_t time) {
-	RS485Driver *rsp = (RS485Driver *)ip;
-	// lock system and UART
+/*
+
+Arm the receive DMA in circular mode over the receive ring. The UART
+driver arms a one character idle loop on start, which is replaced here.
+
+*/
+static void rs485_lld_start_rx(RS485Driver *rsp) {
+	UARTDriver *uartp = rsp->uart;
 	chSysLock();
-	chMtxLockS(&rsp->lock);
-	// start receiving
-	uartStartReceiveI(rsp->uart, n, bp);
-	// wait until finished
-	rsp->err = chBSemWaitTimeoutS(&rsp->ready, time);
-	if (rsp->err != RDY_OK || rsp->e != UART_NO_ERROR) {
-		// stop receiving due to error
-		n = uartStopReceiveI(rsp->uart);
+	dmaStreamDisable(uartp->dmarx);
+	rsp->rxhead = 0;
+	rsp->rxtail = 0;
+	rsp->idlehead = 0;
+	rsp->idlewatch = 0;
+	rsp->e = UART_NO_ERROR;
+	// detect line breaks, which need 8-bit words
+	if (!rsp->addrmark) {
+		uartp->usart->CR2 |= USART_CR2_LINEN;
 	}
-	// unlock UART and system
-	chMtxUnlockS();
+	dmaStreamSetMemory0(uartp->dmarx, rsp->rxring);
+	dmaStreamSetTransactionSize(uartp->dmarx, RS485_RXRING_SIZE);
+	dmaStreamSetMode(uartp->dmarx, uartp->dmamode |
+	                 STM32_DMA_CR_DIR_P2M | STM32_DMA_CR_MINC |
+	                 STM32_DMA_CR_CIRC | STM32_DMA_CR_HTIE |
+	                 STM32_DMA_CR_TCIE);
+	dmaStreamEnable(uartp->dmarx);
 	chSysUnlock();
-	// return number of bytes received
-	return n;
+}
+
+/* Get the time left from `time` since `start`. */
+static systime_t rs485_lld_remaining(systime_t start, systime_t time) {
+	if (time == TIME_INFINITE) {
+		return TIME_INFINITE;
+	}
+	systime_t elapsed = chTimeNow() - start;
+	return elapsed < time ? time - elapsed : TIME_IMMEDIATE;
+}
+
+static size_t readt(void *ip, uint8_t *bp, size_t n, systime_t time) {
+	return rs485Read((RS485Driver *)ip, bp, n, time, NULL, NULL);
 }
 
 static msg_t putt(void *ip, uint8_t b, systime_t timeout) {
@@ -138,8 +305,7 @@ static msg_t putt(void *ip, uint8_t b, systime_t timeout) {
 static msg_t gett(void *ip, systime_t timeout) {
 	uint8_t b = 0;
 	if (readt(ip, &b, 1, timeout) != 1) {
-		RS485Driver *rsp = (RS485Driver *)ip;
-		return rsp->e == UART_NO_ERROR ? rsp->err : RDY_RESET;
+		return ((RS485Driver *)ip)->err;
 	}
 	return b;
 }
@@ -160,34 +326,256 @@ static msg_t get(void *ip) {
 	return gett(ip, TIME_INFINITE);
 }
 
+/* Send queued transmit buffers. */
+static msg_t tx_thread(void *p) {
+	RS485Driver *rsp = p;
+	while (!chThdShouldTerminate()) {
+		msg_t msg;
+		if (chMBFetch(&rsp->txmbox, &msg, TIME_INFINITE) != RDY_OK) {
+			continue;
+		}
+		rs485txbuf_t *tbp = (rs485txbuf_t *)msg;
+		if (tbp->timed) {
+			systime_t wait = tbp->time - chTimeNow();
+			// skip the wait if the time has already passed
+			if ((int32_t)wait > 0) {
+				chThdSleep(wait);
+			}
+		}
+		writet(rsp, tbp->data, tbp->n, MS2ST(100));
+		chPoolFree(&rsp->txpool, tbp);
+	}
+	return RDY_OK;
+}
+
 static const struct BaseAsynchronousChannelVMT vmt = {
 	write, read, put, get,
 	putt, gett, writet, readt
 };
 
 void rs485Init(void) {
-	rs485ObjectInit(&RSD3, &UARTD3);
+	rs485ObjectInit(&RSD3, &UARTD3, &GPTD3);
 }
 
-void rs485ObjectInit(RS485Driver *rsp, UARTDriver *uart) {
+void rs485ObjectInit(RS485Driver *rsp, UARTDriver *uart, GPTDriver *gpt) {
 	rsp->vmt = &vmt;
 	rsp->uart = uart;
+	rsp->config = uartcfg;
+	rsp->gpt = gpt;
 	chMtxInit(&rsp->lock);
 	chBSemInit(&rsp->ready, FALSE);
+	chBSemInit(&rsp->rxready, FALSE);
+	chBSemInit(&rsp->rxidle, TRUE);
+	rsp->e = UART_NO_ERROR;
+	rsp->addrmark = false;
+	rsp->txcr1 = 0;
+	rsp->transmitting = false;
+	rsp->rxhead = 0;
+	rsp->rxtail = 0;
+	rsp->idlehead = 0;
+	rsp->idlewatch = 0;
+	rsp->rxwaiting = false;
+	rsp->breakcb = NULL;
+	memset(&rsp->stats, 0, sizeof(rsp->stats));
+	chPoolInit(&rsp->txpool, sizeof(rs485txbuf_t), NULL);
+	chPoolLoadArray(&rsp->txpool, rsp->txbufs, RS485_TXQUEUE_COUNT);
+	chMBInit(&rsp->txmbox, rsp->txmbox_buf, RS485_TXQUEUE_COUNT);
+	rsp->txthread_tp = NULL;
 }
 
 void rs485Start(RS485Driver *rsp) {
 	// start UART driver
-	uartStart(rsp->uart, &uartcfg);
+	uartStart(rsp->uart, &rsp->config);
+	gptStart(rsp->gpt, &rxidlecfg);
 	// disable transmitter
 	rsp->uart->usart->CR1 &= ~USART_CR1_TE;
+	// enable cycle counter for turnaround measurement
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	// receive continuously into the ring
+	rs485_lld_start_rx(rsp);
+	// start transmit thread
+	if (rsp->txthread_tp == NULL) {
+		rsp->txthread_tp = chThdCreateStatic(
+		                     rsp->txthread_wa, sizeof(rsp->txthread_wa),
+		                     NORMALPRIO + 1, tx_thread, rsp);
+	}
 }
 
 void rs485Stop(RS485Driver *rsp) {
 	// disable RS-485 driver
 	palClearPad(GPIOB, GPIOB_RS485_TXEN);
-	// stop UART driver
+	// stop receive idle timer and UART driver
+	chSysLock();
+	gptStopTimerI(rsp->gpt);
+	chSysUnlock();
+	gptStop(rsp->gpt);
+	uartStop(rsp->uart);
+}
+
+void rs485SetBitrate(RS485Driver *rsp, uint32_t speed) {
+	USART_TypeDef *u = rsp->uart->usart;
+	chMtxLock(&rsp->lock);
+	// save address-mark wakeup configuration
+	uint32_t cr1 = u->CR1 & (USART_CR1_M | USART_CR1_WAKE);
+	uint32_t cr2 = u->CR2 & USART_CR2_ADD;
+	// restart UART driver at new bit rate
+	rsp->config.speed = speed;
 	uartStop(rsp->uart);
+	uartStart(rsp->uart, &rsp->config);
+	u->CR2 |= cr2;
+	// disable transmitter
+	u->CR1 = (u->CR1 & ~USART_CR1_TE) | cr1;
+	// receive continuously into the ring
+	rs485_lld_start_rx(rsp);
+	chMtxUnlock();
+}
+
+size_t rs485Available(RS485Driver *rsp) {
+	chSysLock();
+	size_t n = rs485_lld_rxhead(rsp) - rsp->rxtail;
+	chSysUnlock();
+	return n;
+}
+
+size_t rs485Acquire(RS485Driver *rsp, const uint8_t **bpp, systime_t time) {
+	systime_t start = chTimeNow();
+	size_t n = 0;
+	chSysLock();
+	for (;;) {
+		uint32_t head = rs485_lld_rxhead(rsp);
+		// drop buffered data on receive error
+		if (rsp->e != UART_NO_ERROR) {
+			rsp->e = UART_NO_ERROR;
+			rsp->stats.bytes += head - rsp->rxtail;
+			rsp->rxtail = head;
+			rsp->err = RDY_RESET;
+			break;
+		}
+		// return data up to the end of the ring
+		uint32_t avail = head - rsp->rxtail;
+		if (avail > 0) {
+			size_t off = rsp->rxtail & (RS485_RXRING_SIZE - 1);
+			n = RS485_RXRING_SIZE - off;
+			if (n > avail) {
+				n = avail;
+			}
+			*bpp = &rsp->rxring[off];
+			rsp->err = RDY_OK;
+			break;
+		}
+		// wait for the next half buffer or new bytes found by the timer
+		systime_t wait = rs485_lld_remaining(start, time);
+		if (wait == TIME_IMMEDIATE) {
+			rsp->err = RDY_TIMEOUT;
+			break;
+		}
+		rsp->rxwaiting = true;
+		rs485_lld_watch_idle(rsp);
+		chBSemWaitTimeoutS(&rsp->rxready, wait);
+		rsp->rxwaiting = false;
+	}
+	chSysUnlock();
+	return n;
+}
+
+size_t rs485Read(RS485Driver *rsp, uint8_t *bp, size_t n, systime_t time,
+                 rs485spancb_t cb, void *arg) {
+	systime_t start = chTimeNow();
+	size_t i = 0;
+	while (i < n) {
+		const uint8_t *src;
+		size_t len = rs485Acquire(rsp, &src,
+		                          rs485_lld_remaining(start, time));
+		if (len == 0) {
+			break;
+		}
+		if (len > n - i) {
+			len = n - i;
+		}
+		if (bp != NULL) {
+			memcpy(&bp[i], src, len);
+		}
+		if (cb != NULL) {
+			cb(arg, src, len);
+		}
+		rs485Release(rsp, len);
+		i += len;
+	}
+	// return number of bytes received
+	return i;
+}
+
+void rs485Release(RS485Driver *rsp, size_t n) {
+	chSysLock();
+	rsp->rxtail += n;
+	rsp->stats.bytes += n;
+	chSysUnlock();
+}
+
+rs485txbuf_t *rs485TxAlloc(RS485Driver *rsp) {
+	return chPoolAlloc(&rsp->txpool);
+}
+
+void rs485TxPost(RS485Driver *rsp, rs485txbuf_t *tbp) {
+	tbp->timed = false;
+	// never blocks as there are as many mailbox slots as buffers
+	chMBPost(&rsp->txmbox, (msg_t)tbp, TIME_INFINITE);
+}
+
+void rs485TxPostAt(RS485Driver *rsp, rs485txbuf_t *tbp, systime_t time) {
+	tbp->timed = true;
+	tbp->time = time;
+	// never blocks as there are as many mailbox slots as buffers
+	chMBPost(&rsp->txmbox, (msg_t)tbp, TIME_INFINITE);
+}
+
+msg_t rs485Send(RS485Driver *rsp, const void *bp, size_t n) {
+	rs485txbuf_t *tbp = rs485TxAlloc(rsp);
+	if (tbp == NULL) {
+		return RDY_TIMEOUT;
+	}
+	if (n > RS485_TXBUF_SIZE) {
+		n = RS485_TXBUF_SIZE;
+	}
+	memcpy(tbp->data, bp, n);
+	tbp->n = n;
+	rs485TxPost(rsp, tbp);
+	return RDY_OK;
+}
+
+void rs485GetStats(RS485Driver *rsp, rs485stats_t *stats, bool reset) {
+	chSysLock();
+	*stats = rsp->stats;
+	if (reset) {
+		memset(&rsp->stats, 0, sizeof(rsp->stats));
+	}
+	chSysUnlock();
+}
+
+void rs485SetBreakCallback(RS485Driver *rsp, rs485breakcb_t cb) {
+	chSysLock();
+	rsp->breakcb = cb;
+	chSysUnlock();
+}
+
+void rs485SetAddressMark(RS485Driver *rsp, uint8_t node) {
+	USART_TypeDef *u = rsp->uart->usart;
+	chSysLock();
+	chMtxLockS(&rsp->lock);
+	// the DMA keeps transferring the low eight bits of each word
+	u->CR2 = (u->CR2 & ~(USART_CR2_ADD | USART_CR2_LINEN)) |
+	         (node & USART_CR2_ADD);
+	u->CR1 |= USART_CR1_M | USART_CR1_WAKE;
+	rsp->addrmark = true;
+	chMtxUnlockS();
+	chSysUnlock();
+}
+
+void rs485Mute(RS485Driver *rsp) {
+	chSysLock();
+	rsp->uart->usart->CR1 |= USART_CR1_RWU;
+	chSysUnlock();
 }
 
 void rs485Wait(RS485Driver *rsp) {
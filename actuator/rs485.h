@@ -21,18 +21,99 @@ Low level RS-485 driver implementation. Not thread safe.
 #include <ch.h>
 #include <hal.h>
 
+/*
+
+Size of the circular receive buffer. Must be a power of two. The DMA
+raises an interrupt every half buffer, so at 115200 baud the reader is
+woken at least every ~11 ms while data is streaming in, and the receive
+idle timer wakes it within RS485_IDLE_CHARS character times of the last
+byte received.
+
+*/
+#define RS485_RXRING_SIZE               256
+
+/*
+
+Number of character times without a received byte after which the line
+is taken to be idle. The receive DMA does not interrupt on each byte, so
+while the reader waits or bytes are arriving, a timer samples the DMA
+position at this interval to find new bytes and the end of each frame.
+
+*/
+#define RS485_IDLE_CHARS                2
+
+/* Shortest receive idle timer interval in us, to bound its IRQ rate. */
+#define RS485_IDLE_MIN_US               50
+
+/* Highest bit rate supported by USART3 with 16x oversampling. */
+#define RS485_MAX_BITRATE               (STM32_PCLK1 / 16)
+
+/* Number of queued transmit buffers. */
+#define RS485_TXQUEUE_COUNT             4
+
+/* Size of each transmit buffer. */
+#define RS485_TXBUF_SIZE                256
+
+/* Transmit thread working area size. */
+#define RS485_TXTHREAD_WA_SIZE          256
+
+/* Queued transmit buffer. */
+typedef struct {
+  size_t n;                             // number of bytes to send
+  bool timed;                           // wait until `time` to send
+  systime_t time;                       // system time to send at
+  uint8_t data[RS485_TXBUF_SIZE];       // data to send
+} rs485txbuf_t;
+
+/* Receive error counters. */
+typedef struct {
+  uint32_t bytes;                       // bytes received
+  uint32_t framing;                     // framing errors
+  uint32_t noise;                       // noise errors
+  uint32_t parity;                      // parity errors
+  uint32_t overrun;                     // receive ring or USART overruns
+  uint32_t breaks;                      // line breaks
+  uint32_t turnaround;                  // last TC IRQ to TXEN low, in cycles
+  uint32_t turnaroundmax;               // longest turnaround, in cycles
+} rs485stats_t;
+
+/* Line break callback, called from the ISR with the system locked. */
+typedef void (*rs485breakcb_t)(void);
+
+/* Receive span callback, called with each span of bytes read. */
+typedef void (*rs485spancb_t)(void *arg, const uint8_t *bp, size_t n);
+
 /* RS-485 driver structure. */
 typedef struct {
   const struct BaseAsynchronousChannelVMT *vmt;
   _base_asynchronous_channel_data
   UARTDriver *uart;
+  UARTConfig config;                    // UART configuration
+  GPTDriver *gpt;                       // receive idle timer
   Mutex lock;
-  BinarySemaphore ready;
+  BinarySemaphore ready;                // transmit completion
+  BinarySemaphore rxready;              // receive ring advanced or error
+  BinarySemaphore rxidle;               // line went idle
   uartflags_t e;
   msg_t err;
-  uint8_t *buf;
-  size_t len;
-  size_t i;
+  bool addrmark;                        // address-mark wakeup enabled
+  uint32_t txcr1;                       // receiver state during transmit
+  volatile bool transmitting;           // waiting for the TC interrupt
+  uint8_t rxring[RS485_RXRING_SIZE];    // circular DMA receive buffer
+  volatile uint32_t rxhead;             // bytes received at last half
+  volatile uint32_t idlehead;           // bytes received at last idle line
+  uint32_t idlewatch;                   // bytes received at last timer tick
+  volatile bool rxwaiting;              // reader waiting for data
+  uint32_t rxtail;                      // bytes consumed
+  rs485breakcb_t breakcb;               // line break callback
+  rs485stats_t stats;                   // receive error counters
+  /* Transmit queue. */
+  MemoryPool txpool;                    // free transmit buffers
+  Mailbox txmbox;                       // transmit buffers to send
+  msg_t txmbox_buf[RS485_TXQUEUE_COUNT];
+  rs485txbuf_t txbufs[RS485_TXQUEUE_COUNT];
+  WORKING_AREA(txthread_wa, RS485_TXTHREAD_WA_SIZE);
+  Thread *txthread_tp;                  // transmit thread
 } RS485Driver;
 
 /* RS-485 driver associated with USART3. */
@@ -47,9 +128,10 @@ Initialize RS-485 driver.
 
 @param rsp Pointer to RS-485 driver
 @param uart Pointer to UART driver
+@param gpt Pointer to GPT driver for the receive idle timer
 
 */
-void rs485ObjectInit(RS485Driver *rsp, UARTDriver *uart);
+void rs485ObjectInit(RS485Driver *rsp, UARTDriver *uart, GPTDriver *gpt);
 
 /*
 
@@ -71,6 +153,174 @@ void rs485Stop(RS485Driver *rsp);
 
 /*
 
+Change the bit rate. Waits for a transmission in progress to finish and
+drops any data in the receive ring. Address-mark wakeup is preserved.
+
+@param rsp Pointer to RS-485 driver
+@param speed Bit rate, at most RS485_MAX_BITRATE
+
+*/
+void rs485SetBitrate(RS485Driver *rsp, uint32_t speed);
+
+/*
+
+Get the number of received bytes waiting in the receive ring.
+
+@param rsp Pointer to RS-485 driver
+@return Number of bytes available
+
+*/
+size_t rs485Available(RS485Driver *rsp);
+
+/*
+
+Wait for received data and get a pointer to it in the receive ring.
+
+The returned span is contiguous and may hold fewer bytes than are
+available when the data wraps around the end of the ring. The bytes
+remain in the ring until released with `rs485Release()`. On timeout or
+receive error, zero is returned and `rsp->err` holds the reason.
+
+@param rsp Pointer to RS-485 driver
+@param bpp Pointer to save the start of the span
+@param time Timeout
+@return Number of bytes in the span
+
+*/
+size_t rs485Acquire(RS485Driver *rsp, const uint8_t **bpp, systime_t time);
+
+/*
+
+Read bytes from the receive ring, waiting until all have arrived or the
+timeout expires. The callback is called with each contiguous span of the
+bytes once it is copied to `bp`, so that the caller can process the data
+while the rest arrives.
+
+@param rsp Pointer to RS-485 driver
+@param bp Buffer to save data, or NULL to discard
+@param n Number of bytes to read
+@param time Timeout for all bytes
+@param cb Span callback, or NULL
+@param arg Argument for the callback
+@return Number of bytes read
+
+*/
+size_t rs485Read(RS485Driver *rsp, uint8_t *bp, size_t n, systime_t time,
+                 rs485spancb_t cb, void *arg);
+
+/*
+
+Release bytes obtained from `rs485Acquire()`.
+
+@param rsp Pointer to RS-485 driver
+@param n Number of bytes to consume
+
+*/
+void rs485Release(RS485Driver *rsp, size_t n);
+
+/*
+
+Get a free transmit buffer without waiting.
+
+@param rsp Pointer to RS-485 driver
+@return Transmit buffer, or NULL if all buffers are queued
+
+*/
+rs485txbuf_t *rs485TxAlloc(RS485Driver *rsp);
+
+/*
+
+Queue a transmit buffer obtained from `rs485TxAlloc()`. The buffer is
+sent by the transmit thread and then returned to the free buffers.
+
+@param rsp Pointer to RS-485 driver
+@param tbp Transmit buffer with `n` set to the number of bytes to send
+
+*/
+void rs485TxPost(RS485Driver *rsp, rs485txbuf_t *tbp);
+
+/*
+
+Queue a transmit buffer obtained from `rs485TxAlloc()` to be sent no
+earlier than the given system time. Buffers are sent in order, so later
+buffers wait for this one.
+
+@param rsp Pointer to RS-485 driver
+@param tbp Transmit buffer with `n` set to the number of bytes to send
+@param time System time to send at
+
+*/
+void rs485TxPostAt(RS485Driver *rsp, rs485txbuf_t *tbp, systime_t time);
+
+/*
+
+Copy data into a transmit buffer and queue it without waiting.
+
+@param rsp Pointer to RS-485 driver
+@param bp Data to send
+@param n Number of bytes to send, at most `RS485_TXBUF_SIZE`
+@return RDY_OK if queued or RDY_TIMEOUT if the queue is full
+
+*/
+msg_t rs485Send(RS485Driver *rsp, const void *bp, size_t n);
+
+/*
+
+Get the receive error counters and the transmit turnaround, the time
+measured with the cycle counter from taking the TC interrupt at the end
+of a response to driving TXEN low and re-enabling the receiver. The
+interrupt entry latency before the TC callback is not included.
+
+@param rsp Pointer to RS-485 driver
+@param stats Pointer to save the counters
+@param reset Reset the counters after reading them
+
+*/
+void rs485GetStats(RS485Driver *rsp, rs485stats_t *stats, bool reset);
+
+/*
+
+Set the callback for a line break on the bus, sent by the master to stop
+all boards out of band, even in the middle of a frame. The callback is
+invoked from the receive error ISR as soon as the break is detected, and
+the data received so far is dropped. Break detection is not available
+with address-mark wakeup.
+
+@param rsp Pointer to RS-485 driver
+@param cb The callback, or NULL
+
+*/
+void rs485SetBreakCallback(RS485Driver *rsp, rs485breakcb_t cb);
+
+/*
+
+Enable address-mark wakeup.
+
+The USART is switched to 9-bit words. A word with the ninth bit set is an
+address mark; while muted, the USART ignores all words until an address
+mark whose low four bits match `node` is received. Address marks for
+other nodes mute the USART in hardware, so frames for other boards are
+never written to the receive ring. Data and responses are sent with the
+ninth bit clear. Line break detection is disabled.
+
+@param rsp Pointer to RS-485 driver
+@param node Four bit node address
+
+*/
+void rs485SetAddressMark(RS485Driver *rsp, uint8_t node);
+
+/*
+
+Enter mute mode without waiting. The receiver wakes when the line is
+idle or, with address-mark wakeup, on an address mark for this node.
+
+@param rsp Pointer to RS-485 driver
+
+*/
+void rs485Mute(RS485Driver *rsp);
+
+/*
+
 Wait until the line is idle.
 
 @param rsp Pointer to RS-485 driver